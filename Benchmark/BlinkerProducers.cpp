@@ -0,0 +1,66 @@
+// Contention benchmark of emitting signals from multiple producer threads,
+// while the main thread keeps flipping and polling.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "Blinker.h"
+
+struct Event
+{
+	int producer, seq;
+};
+
+// Returns the throughput, in million events per second.
+static double Run(int nProducers, int nEventsTotal)
+{
+	Blinker::Board<64> board;
+	auto			   signal = board.NewSignal("x");
+	auto			   connection = board.Connect({ "x" });
+
+	std::vector<Blinker::Producer<64>*> producers;
+	for (int i = 0; i < nProducers; i++)
+		producers.push_back(board.NewProducer(4096));
+
+	const int		  nEvents = nEventsTotal / nProducers;
+	std::atomic<bool> start = false;
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < nProducers; i++)
+		threads.emplace_back([&, i]() {
+			while (!start.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			for (int j = 0; j < nEvents; j++)
+				while (!producers[i]->Emit(signal->Id(), Event{ i, j }))
+					std::this_thread::yield();
+		});
+
+	long long received = 0, sum = 0;
+	auto	  begin = std::chrono::steady_clock::now();
+	start.store(true, std::memory_order_release);
+
+	while (received < static_cast<long long>(nEvents) * nProducers)
+	{
+		board.Flip();
+		connection->PollPayload([&](Blinker::SignalId, const Blinker::Payload& data) {
+			sum += data.As<Event>().seq, ++received;
+		});
+	}
+
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	for (auto& t : threads)
+		t.join();
+	return received / elapsed / 1e6;
+}
+
+int main(void)
+{
+	const int nEventsTotal = 1 << 23;
+	std::printf("%-10s %s\n", "producers", "M events/s");
+	for (int n = 1; n <= 32; n *= 2)
+		std::printf("%-10d %.2f\n", n, Run(n, nEventsTotal));
+	return 0;
+}
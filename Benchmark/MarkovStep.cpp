@@ -0,0 +1,64 @@
+// Benchmark of MarkovChain steps over a pool, in samples per second.
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "Pdfsm.h"
+
+enum class S
+{
+	S0,
+	S1,
+	S2,
+	S3,
+	N
+};
+
+template <S State>
+class Behavior : public Pdfsm::StateBehavior<State>
+{
+};
+
+// Returns the throughput, in million samples per second.
+static double Run(std::size_t nMachines)
+{
+	// A ring, each state stays or moves forward.
+	Pdfsm::TransitionTable<S> transitions = {
+		{ S::S0, { S::S0, S::S1 }, nullptr, { 3, 1 } },
+		{ S::S1, { S::S1, S::S2 }, nullptr, { 3, 1 } },
+		{ S::S2, { S::S2, S::S3 }, nullptr, { 3, 1 } },
+		{ S::S3, { S::S3, S::S0 }, nullptr, { 3, 1 } },
+	};
+	std::vector<std::unique_ptr<Pdfsm::IStateBehavior<S>>> behaviors;
+	behaviors.push_back(std::make_unique<Behavior<S::S0>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S1>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S2>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S3>>());
+	Pdfsm::StateMachineHandler<S> h(std::move(behaviors), transitions);
+	Pdfsm::MarkovChain<S>		  chain(transitions);
+	Pdfsm::StateMachinePool<S>	  pool;
+	Pdfsm::Context				  ctx;
+	Pdfsm::CounterRng			  rng{ 42 };
+
+	pool.Reserve(nMachines);
+	for (std::size_t i = 0; i < nMachines; ++i)
+		pool.New();
+	h.Update(pool, ctx);
+
+	const int steps = 20;
+	auto	  begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < steps; ++i)
+		chain.Step(pool, rng);
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return steps * nMachines / elapsed / 1e6;
+}
+
+int main(void)
+{
+	std::printf("%-10s %s\n", "machines", "M samples/s");
+	for (std::size_t n = 1000; n <= 1000000; n *= 10)
+		std::printf("%-10zu %.2f\n", n, Run(n));
+	return 0;
+}
@@ -0,0 +1,88 @@
+// Benchmark of utility-scored transition selection, the time per decision made by
+// UtilitySelector, scoring by batch kernels and by per-machine functions.
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "Pdfsm.h"
+
+enum class S
+{
+	S0,
+	S1,
+	S2,
+	S3,
+	S4,
+	S5,
+	S6,
+	S7,
+	N
+};
+
+template <S State>
+class Behavior : public Pdfsm::StateBehavior<State>
+{
+};
+
+// Returns the nanoseconds per decision.
+static double Run(std::size_t nMachines, bool batched)
+{
+	const int N = static_cast<int>(S::N);
+
+	// All states are reachable from any state.
+	std::vector<std::unique_ptr<Pdfsm::IStateBehavior<S>>> behaviors;
+	behaviors.push_back(std::make_unique<Behavior<S::S0>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S1>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S2>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S3>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S4>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S5>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S6>>());
+	behaviors.push_back(std::make_unique<Behavior<S::S7>>());
+	Pdfsm::StateMachineHandler<S> h(std::move(behaviors), Pdfsm::TransitionTable<S>{},
+		{ { { S::S0, S::S1, S::S2, S::S3, S::S4, S::S5, S::S6, S::S7 } } });
+	Pdfsm::StateMachinePool<S> pool;
+	Pdfsm::UtilitySelector<S>  selector;
+	Pdfsm::Context			   ctx;
+
+	// Field s is the utility of target s.
+	pool.EnableFields(N);
+	pool.Reserve(nMachines);
+	std::mt19937						  rng(42);
+	std::uniform_real_distribution<float> dist(0, 1);
+	for (std::size_t i = 0; i < nMachines; ++i)
+	{
+		auto x = pool.New();
+		for (int s = 0; s < N; ++s)
+			pool.Field(s, x) = dist(rng);
+	}
+	h.Update(pool, ctx);
+
+	for (int s = 0; s < N; ++s)
+		if (batched)
+			selector.Score(static_cast<S>(s), [&pool, s](const Pdfsm::Handle* hs, std::size_t n, float* scores) {
+				const float* column = pool.Field(s);
+				for (std::size_t i = 0; i < n; ++i)
+					scores[i] = column[hs[i]];
+			});
+		else
+			selector.ScoreEach(static_cast<S>(s), [&pool, s](Pdfsm::Handle x) { return pool.Field(s, x); });
+
+	const int rounds = 20;
+	auto	  begin = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; ++r)
+		selector.Choose(h, pool, ctx);
+	auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+	return elapsed / rounds / nMachines;
+}
+
+int main(void)
+{
+	std::printf("%-10s %-14s %s\n", "machines", "batched ns", "per-machine ns");
+	for (std::size_t n = 1000; n <= 1000000; n *= 10)
+		std::printf("%-10zu %-14.2f %.2f\n", n, Run(n, true), Run(n, false));
+	return 0;
+}
@@ -12,23 +12,66 @@
 //
 // Requires: C++20
 //
-// verison 0.2.0
+// verison 0.3.0
 
 // Changes
 // ~~~~~~~~
+// v0.3.0 Add StateMachinePool, dormant machines are excluded from batched updates.
+//        Add budgeted batched updates with round-robin resumption.
+//        Add Ticker to fill Context seq and delta, with fixed timestep mode.
+//        Add SignalRouter to deliver signals only to machines in subscribing states.
+//        Add lock-free per-machine inboxes and the OnEvent hook.
+//        Add per-machine event queues with priorities and coalescing.
+//        Add ActorRuntime to run state machines as actors on worker threads.
+//        Add the OnReady hook, and an optional epoll reactor in PdfsmReactor.h.
+//        Add WaitFor to block or co_await until a machine reaches given states.
+//        Add ScriptBehavior, states authored as coroutines with pooled frames.
+//        Add JumpAsync, transitions with multi-tick Exiting and Entering phases.
+//        Add Hierarchy, hierarchical states with compile-time ancestor tables.
+//        Add RegionalStateMachine, orthogonal regions packed in one machine, updated in one pass.
+//        Add NestedStateMachine and SubMachineBehavior, child machines inside states, inline or in pools.
+//        Add DataStateMachine and DataBehavior, typed per-state data in stack frames.
+//        Add wildcard transitions, from any state, any except some, or a group.
+//        Add opt-in locks of target states for machines in a pool, checked with the transition table.
+//        Add guarded transitions and GuardProgram, guards over field columns of a pool.
+//        Add RuleEngine, threshold transition rules evaluated over field columns.
+//        Add UtilitySelector, choosing the best scored legal targets for groups of machines.
+//        Add JumpPath and PushPath, following shortest routes by a precomputed next-hop table.
+//        Add MarkovChain, weighted transitions sampled by alias tables, and CounterRng.
 // v0.2.0 Breaking change: change coding style
 
 #ifndef HIT9_PDFSM_H
 #define HIT9_PDFSM_H
 
+#include <algorithm>
 #include <any>
+#include <atomic>
 #include <bitset>
 #include <cassert>
 #include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <initializer_list>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <vector>
 
 namespace Pdfsm
 {
@@ -43,7 +86,7 @@ namespace Pdfsm
 		// ticking seq number.
 		unsigned long long seq = 0; // cppcheck-suppress
 		// delta time since last tick.
-		std::chrono::nanoseconds delta;
+		std::chrono::nanoseconds delta{ 0 };
 		// user data.
 		std::any data;
 
@@ -52,6 +95,15 @@ namespace Pdfsm
 			: data(data) {}
 	};
 
+	// Event is a point-to-point message to a state machine.
+	struct Event
+	{
+		// user defined event id.
+		unsigned int id = 0;
+		// user data.
+		std::any data;
+	};
+
 	//////////////////////
 	/// State
 	//////////////////////
@@ -100,6 +152,21 @@ namespace Pdfsm
 		virtual void OnResume(const Context& ctx) {}
 		virtual bool BeforeUpdate(const Context& ctx) { return false; }
 		virtual void Update(const Context& ctx) {}
+		// Called on a routed signal fired, returns true to stop delivering more signals.
+		virtual bool OnSignal(const Context& ctx, std::size_t signalId, const std::any& data) { return false; }
+		// Called on an event posted to the machine, right before BeforeUpdate.
+		virtual void OnEvent(const Context& ctx, const Event& event) {}
+		// Called on a file descriptor registered for the machine becoming ready, see PdfsmReactor.h.
+		virtual void OnReady(const Context& ctx, int fd, std::uint32_t events) {}
+		// Called on each tick of the Exiting phase of an asynchronous transition out of this state,
+		// returns the progress, the phase completes once it reaches 1.
+		virtual float OnExiting(const Context& ctx) { return 1.0f; }
+		// Called on each tick of the Entering phase of an asynchronous transition into this state,
+		// right after OnEnter, returns the progress, the phase completes once it reaches 1.
+		virtual float OnEntering(const Context& ctx) { return 1.0f; }
+		// Returns whether the state accepts entry data of the type identified by given key, or
+		// entering without data if the key is null, see DataBehavior.
+		virtual bool AcceptsEntry(const void* key) const { return key == nullptr; }
 	};
 
 	// internal helper class.
@@ -137,15 +204,116 @@ namespace Pdfsm
 	{
 		State						 from;
 		std::initializer_list<State> targets;
+		// Optional guard expression, i.e. "speed > 0.1 && !stunned", the transition fires
+		// once it holds (see GuardProgram). The guard only gates the firing by a GuardProgram,
+		// the transition is still valid by the table, so Jump doesn't evaluate it.
+		const char* guard = nullptr;
+		// Optional weights of the targets, the probabilities are proportional (see MarkovChain).
+		std::initializer_list<float> weights = {};
 	};
 
 	template <EnumClass State>
 	using TransitionTable = std::initializer_list<Transition<State>>;
 
+	// Wildcard is a transition rule from many states to given targets:
+	// from any state if both from and except are empty, from any state except some,
+	// or from a group of states.
+	template <EnumClass State>
+	struct Wildcard
+	{
+		std::initializer_list<State> targets;
+		std::initializer_list<State> except = {};
+		std::initializer_list<State> from = {};
+	};
+
+	template <EnumClass State>
+	using WildcardTable = std::initializer_list<Wildcard<State>>;
+
+	//////////////////////
+	/// Hierarchy
+	//////////////////////
+
+	// Hierarchy is a parent relation over the states, built at compile time:
+	//
+	//   constexpr Pdfsm::Hierarchy<S> hierarchy = { { S::Melee, S::Combat }, { S::Ranged, S::Combat } };
+	//
+	// Ancestor paths and transition scopes are precomputed into flat tables, so that a
+	// hierarchical transition costs a few table lookups, without walking the tree.
+	template <EnumClass State>
+	class Hierarchy
+	{
+	public:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+
+		struct Relation
+		{
+			State child, parent;
+		};
+
+		constexpr Hierarchy(std::initializer_list<Relation> relations)
+		{
+			for (int s = 0; s < N; ++s)
+				parent[s] = -1;
+			for (const auto& r : relations)
+				parent[static_cast<int>(r.child)] = static_cast<int>(r.parent);
+			for (int s = 0; s < N; ++s)
+			{
+				int d = 0;
+				for (int x = parent[s]; x >= 0; x = parent[x])
+					if (++d >= N)
+						throw std::runtime_error("pdfsm: cyclic hierarchy");
+				depth[s] = d;
+				for (int x = s, k = d; x >= 0; x = parent[x], --k)
+					path[s][k] = x;
+			}
+			for (int a = 0; a < N; ++a)
+				for (int b = 0; b < N; ++b)
+				{
+					// A self transition exits and re-enters the state.
+					if (a == b)
+					{
+						scope[a][b] = parent[a];
+						continue;
+					}
+					int k = 0;
+					while (k <= depth[a] && k <= depth[b] && path[a][k] == path[b][k])
+						++k;
+					scope[a][b] = k > 0 ? path[a][k - 1] : -1;
+				}
+		}
+
+		// Returns the parent of state s, -1 for none.
+		constexpr int Parent(int s) const { return parent[s]; }
+		// Returns the depth of state s, 0 for roots, -1 for none (s = -1).
+		constexpr int Depth(int s) const { return s < 0 ? -1 : depth[s]; }
+		// Returns the ancestor of state s at depth d.
+		constexpr int Ancestor(int s, int d) const { return path[s][d]; }
+		// Returns the deepest state not exited by the transition from a to b, -1 for none,
+		// i.e. their least common ancestor.
+		constexpr int Scope(int a, int b) const { return scope[a][b]; }
+
+	private:
+		int parent[N]{}, depth[N]{};
+		// path[s][0..depth[s]] is the ancestors of s from the root, ending with s itself.
+		int path[N][N]{};
+		int scope[N][N]{};
+	};
+
 	//////////////////////
 	/// StateMachine
 	//////////////////////
 
+	// Phase of an asynchronous transition.
+	enum class Phase : unsigned char
+	{
+		None,
+		// The source state is still on the top, exiting.
+		Exiting,
+		// The target state is on the top, entering.
+		Entering,
+	};
+
 	// StateMachine is just plain struct storing active states.
 	template <EnumClass State>
 	struct StateMachine
@@ -156,126 +324,3442 @@ namespace Pdfsm
 		// The initial state is state 0.
 		// top=-1 meaning this state machine still not started.
 		int stack[N], top = -1;
+		// Asynchronous transition in progress, its phase, target state and
+		// the progress of the phase.
+		Phase phase = Phase::None;
+		int	  target = -1;
+		float progress = 0;
 	};
 
-	/////////////////////////
-	/// StateMachineHandler
-	/////////////////////////
-
+	// internal, a reference to the stack of a machine being handled, or a region's stack.
 	template <EnumClass State>
-	class StateMachineHandler
+	struct StackRef
+	{
+		int*   stack;
+		int&   top;
+		Phase& phase;
+		int&   target;
+		float& progress;
+	};
+
+	// internal helper, the address of TypeKey<T> identifies type T.
+	template <typename T>
+	inline constexpr char TypeKey = 0;
+
+	// Returns the max size of given types, i.e. for the frame size of a DataStateMachine.
+	template <typename... Data>
+	inline constexpr std::size_t MaxSizeOf = std::max({ sizeof(Data)... });
+
+	// DataStateMachine is a state machine whose stack frames carry the data of the states
+	// (see DataBehavior) inline, each frame is of given size, aligned to std::max_align_t.
+	template <EnumClass State, std::size_t FrameSize>
+	struct DataStateMachine : StateMachine<State>
+	{
+		// Size of a frame, rounded up to keep frames aligned.
+		static constexpr std::size_t Stride = (FrameSize + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+		// data[i] is the frame of stack[i].
+		alignas(std::max_align_t) std::byte data[StateMachine<State>::N][Stride];
+	};
+
+	// NestedStateMachine is a state machine carrying the machines of its sub-machine states
+	// (see SubMachineBehavior) inline, one for each child enum.
+	template <EnumClass State, EnumClass... Children>
+	struct NestedStateMachine : StateMachine<State>
+	{
+		std::tuple<StateMachine<Children>...> children;
+
+		template <EnumClass ChildState>
+		StateMachine<ChildState>& Child(void) { return std::get<StateMachine<ChildState>>(children); }
+
+		// Locates the child machine of the enum identified by given key, nullptr if not found.
+		static void* Locate(StateMachine<State>* fsm, const void* key)
+		{
+			auto  self = static_cast<NestedStateMachine*>(fsm);
+			void* child = nullptr;
+			((key == &TypeKey<Children> ? (child = &self->template Child<Children>()) : nullptr), ...);
+			return child;
+		}
+	};
+
+	// RegionalStateMachine is a state machine with orthogonal regions, each a pushdown stack
+	// over a slice of the enum, given by the first state of each region, in increasing order:
+	//
+	//   Pdfsm::RegionalStateMachine<Npc, Npc::Idle, Npc::Neutral> // Idle, Walk | Neutral, Happy
+	//
+	// The stacks of the regions are stored adjacently, each sized to its slice, so it's as large
+	// as a plain machine plus a top for each region. A single handler handles all regions,
+	// and asynchronous transitions are not supported.
+	template <EnumClass State, State... Firsts>
+	struct RegionalStateMachine
 	{
-	private:
 		// N is the max value of this enum class, aka the size.
 		static const int N = static_cast<int>(State::N);
-		// (Compressed) transition table, tt[from][to]
-		std::bitset<N> tt[N];
-		// Behavior pointers array.
-		// bt[state enum integer] => raw pointer to the behavior instance.
-		IStateBehavior<State>* bt[N];
-		// Currently processing fsm.
-		StateMachine<State>* m = nullptr;
+		// K is the number of regions.
+		static constexpr int K = sizeof...(Firsts);
 
-	protected:
-		// throws a runtime_error if the transition is invalid.
-		inline void Check(int from, int to) const
+		// first[r] is the first state of region r, and first[K] is N.
+		static constexpr int first[K + 1] = { static_cast<int>(Firsts)..., N };
+		static_assert(first[0] == 0, "the first region should start with state 0");
+		static_assert(std::is_sorted(first, first + K + 1), "regions should be in increasing order");
+
+		// region[s] is the region of state s.
+		static constexpr auto region = []() {
+			struct
+			{
+				int r[N];
+			} t{};
+			for (int r = 0; r < K; ++r)
+				for (int s = first[r]; s < first[r + 1]; ++s)
+					t.r[s] = r;
+			return t;
+		}();
+
+		// top[r] is the top of region r's stack, -1 for not started.
+		int top[K];
+		// Stacks of the regions, region r's is stack[first[r]] ... stack[first[r + 1] - 1].
+		int stack[N];
+
+		RegionalStateMachine() { std::fill_n(top, K, -1); }
+	};
+
+	//////////////////////
+	/// Inbox
+	//////////////////////
+
+	// MpscQueue is an intrusive multi-producer single-consumer queue (Dmitry Vyukov's).
+	// Node must have a member `std::atomic<Node*> next`.
+	// Pushing is wait-free, a single atomic exchange.
+	template <typename Node>
+	class MpscQueue
+	{
+	public:
+		MpscQueue()
+			: head(&stub), tail(&stub) { stub.next.store(nullptr, std::memory_order_relaxed); }
+
+		MpscQueue(const MpscQueue&) = delete;
+
+		// Pushes a node, safe to call from any thread.
+		void Push(Node* n)
 		{
-			if (!tt[from][to])
-				throw std::runtime_error("pdfsm: invalid jump from " + std::to_string(from) + " to " + std::to_string(to));
+			n->next.store(nullptr, std::memory_order_relaxed);
+			auto prev = head.exchange(n, std::memory_order_acq_rel);
+			prev->next.store(n, std::memory_order_release);
 		}
-		inline int C(State state) const { return static_cast<int>(state); }
 
-		// Setup this state machine by a behaviors table and a transitions table.
-		void Setup(const StateBehaviorTable<State>& behaviors,
-			const TransitionTable<State>&			transitions)
+		// Pops a node, only the consumer thread can call.
+		// Returns nullptr if empty, or a producer is in the middle of pushing.
+		Node* Pop(void)
 		{
-			// Setup behaviors.
-			for (auto& b : behaviors)
+			auto t = tail;
+			auto next = t->next.load(std::memory_order_acquire);
+			if (t == &stub)
 			{
-				auto state = b->StateValue();
-				bt[C(state)] = b.get();
-				b->BindHandler(this);
-				b->OnSetup();
+				if (next == nullptr)
+					return nullptr;
+				tail = t = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if (next != nullptr)
+			{
+				tail = next;
+				return t;
 			}
+			if (t != head.load(std::memory_order_acquire))
+				return nullptr;
+			Push(&stub);
+			next = t->next.load(std::memory_order_acquire);
+			if (next == nullptr)
+				return nullptr;
+			tail = next;
+			return t;
+		}
 
-			// Setup transitions.
-			for (const auto& t : transitions)
-				for (const auto& to : t.targets)
-				{
-					tt[C(t.from)][C(to)] = 1;
-				}
+	private:
+		alignas(64) std::atomic<Node*> head;
+		alignas(64) Node* tail;
+		Node stub;
+	};
+
+	// EventNode is a node of an inbox, carrying an event.
+	struct EventNode
+	{
+		std::atomic<EventNode*> next;
+		Event					event;
+		// Next free node's index + 1 in the pool, 0 for none.
+		std::atomic<std::uint32_t> nextFree;
+	};
+
+	// EventPool is a fixed-capacity pool of event nodes shared by inboxes.
+	// Acquiring and releasing are lock-free, by a tagged free stack.
+	class EventPool
+	{
+	public:
+		explicit EventPool(std::size_t capacity)
+			: nodes(new EventNode[capacity]), capacity(capacity)
+		{
+			for (std::size_t i = 0; i < capacity; ++i)
+				nodes[i].nextFree.store(i + 1 < capacity ? i + 2 : 0, std::memory_order_relaxed);
+			top.store(capacity > 0 ? 1 : 0, std::memory_order_relaxed);
+		}
+
+		std::size_t Capacity(void) const { return capacity; }
+
+		// Acquires a free node, returns nullptr if exhausted.
+		EventNode* Acquire(void)
+		{
+			auto t = top.load(std::memory_order_acquire);
+			while (static_cast<std::uint32_t>(t) != 0)
+			{
+				auto n = &nodes[static_cast<std::uint32_t>(t) - 1];
+				// The tag (higher 32 bits) prevents ABA.
+				auto next = ((t >> 32) + 1) << 32 | n->nextFree.load(std::memory_order_relaxed);
+				if (top.compare_exchange_weak(t, next, std::memory_order_acq_rel, std::memory_order_acquire))
+					return n;
+			}
+			return nullptr;
+		}
+
+		// Releases a node back to the pool.
+		void Release(EventNode* n)
+		{
+			n->event.data.reset();
+			std::uint64_t index = static_cast<std::uint64_t>(n - nodes.get()) + 1;
+			auto		  t = top.load(std::memory_order_relaxed);
+			do
+				n->nextFree.store(static_cast<std::uint32_t>(t), std::memory_order_relaxed);
+			while (!top.compare_exchange_weak(t, ((t >> 32) + 1) << 32 | index, std::memory_order_release, std::memory_order_relaxed));
 		}
 
+	private:
+		std::unique_ptr<EventNode[]> nodes;
+		std::size_t					 capacity;
+		// Tag (higher 32 bits) and the top free node's index + 1 (lower 32 bits).
+		std::atomic<std::uint64_t> top;
+	};
+
+	// Coalescing policy of an event type in event queues.
+	enum class Coalescing
+	{
+		None,
+		// Replaces the queued event of the same type, the latest wins.
+		Replace,
+		// Merges into the queued event of the same type, by EventPolicy::accumulate.
+		Accumulate,
+		// Drops the incoming event if there's a queued one of the same type.
+		DropDuplicate,
+	};
+
+	// EventPolicy declares how events of a type are queued.
+	struct EventPolicy
+	{
+		// 0 is the most urgent.
+		unsigned int priority = 0;
+		Coalescing	 coalescing = Coalescing::None;
+		// Merges an incoming event into the queued one, for Coalescing::Accumulate.
+		std::function<void(Event& queued, const Event& incoming)> accumulate;
+	};
+
+	// Inbox is a state machine's queue of events posted from any thread.
+	struct Inbox
+	{
+		MpscQueue<EventNode> events;
+		// Link of the pool's ready queue.
+		std::atomic<Inbox*> next;
+		// Whether this inbox is in the ready queue.
+		std::atomic<bool> ready = false;
+		// Number of events pending, used by ActorRuntime.
+		std::atomic<long long> pending = 0;
+		// Handle of the owner machine.
+		std::uint32_t handle = 0;
+	};
+
+	//////////////////////
+	/// Script
+	//////////////////////
+
+	// FramePool is a fixed-capacity pool of fixed-size coroutine frames.
+	// All frames are allocated up front, so a script never touches the global heap.
+	// It's thread-safe, i.e. scripts of machines processed by ActorRuntime workers.
+	class FramePool
+	{
 	public:
-		StateMachineHandler(const auto& behaviors, const auto& transitions)
+		FramePool(std::size_t frameSize, std::size_t capacity)
+			: blockSize(Header + (frameSize + Header - 1) / Header * Header),
+			  storage(new std::max_align_t[blockSize * capacity / Header]), capacity(capacity)
 		{
-			Setup(behaviors, transitions);
+			auto base = reinterpret_cast<char*>(storage.get());
+			for (std::size_t i = capacity; i > 0; --i)
+			{
+				auto block = base + (i - 1) * blockSize;
+				*reinterpret_cast<FramePool**>(block) = this;
+				*reinterpret_cast<void**>(block + Header) = head;
+				head = block + Header;
+			}
 		}
 
-		// Sets current handling fsm.
-		void SetHandlingFsm(StateMachine<State>& fsm, const Context& ctx)
+		FramePool(const FramePool&) = delete;
+
+		std::size_t Capacity(void) const { return capacity; }
+		std::size_t NumFree(void) const
 		{
-			m = &fsm;
-			if (m->top == -1)
-				Jump(ctx, static_cast<State>(0));
+			std::lock_guard<std::mutex> lock(mutex);
+			return nFree;
 		}
 
-		// Clears current handling fsm.
-		void ClearHandlingFsm(void) { m = nullptr; }
+		// Allocates a frame, throws std::bad_alloc if it's too large or the pool is exhausted.
+		void* Allocate(std::size_t n)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (n > blockSize - Header || head == nullptr)
+				throw std::bad_alloc();
+			auto p = head;
+			head = *reinterpret_cast<void**>(p);
+			--nFree;
+			return p;
+		}
 
-		// Returns current active state.
-		State Top(void) const
+		// Releases a frame to the pool it's allocated from.
+		static void Deallocate(void* p)
 		{
-			assert(m != nullptr);
-			assert(m->top >= 0);
-			return static_cast<State>(m->stack[m->top]);
+			auto						pool = *reinterpret_cast<FramePool**>(static_cast<char*>(p) - Header);
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			*reinterpret_cast<void**>(p) = pool->head;
+			pool->head = p;
+			++pool->nFree;
 		}
 
-		// Propagates ticking to current active state.
-		void Update(const Context& ctx)
+	private:
+		// Each block starts with its owner pool, padded to keep frames aligned.
+		static constexpr std::size_t Header = alignof(std::max_align_t);
+
+		std::size_t							blockSize;
+		std::unique_ptr<std::max_align_t[]> storage;
+		std::size_t							capacity, nFree = capacity;
+		void*								head = nullptr;
+		// Scripts of different machines may start and end on different worker threads.
+		mutable std::mutex mutex;
+	};
+
+	struct ScriptPromise;
+
+	// Script is the return type of a ScriptBehavior's coroutine.
+	struct Script
+	{
+		using promise_type = ScriptPromise;
+
+		std::coroutine_handle<ScriptPromise> co;
+	};
+
+	// ScriptPromise tracks what a script is awaiting.
+	struct ScriptPromise
+	{
+		enum class Awaiting
 		{
-			assert(m != nullptr);
-			if (bt[m->stack[m->top]]->BeforeUpdate(ctx))
-				return;
-			bt[m->stack[m->top]]->Update(ctx);
+			None,
+			Tick,
+			Delay,
+			Event,
+		};
+
+		Awaiting				 awaiting = Awaiting::None;
+		std::chrono::nanoseconds remaining{ 0 };
+		// Awaited event id, or any event if matchAny.
+		unsigned int eventId = 0;
+		bool		 matchAny = false;
+		// Context of the current resumption, and the event resumed by.
+		const Context* ctx = nullptr;
+		const Event*   event = nullptr;
+		// Whether it's running, and whether the state is terminated meanwhile.
+		bool running = false, terminated = false;
+
+		// Frames are allocated from the frame pool of the behavior's pool.
+		template <typename Behavior, typename... Args>
+		static void* operator new(std::size_t n, Behavior& self, const Args&...)
+		{
+			return self.ScriptFrames().Allocate(n);
+		}
+		static void operator delete(void* p, std::size_t) { FramePool::Deallocate(p); }
+		// Matches the placement operator new.
+		template <typename Behavior, typename... Args>
+		static void operator delete(void* p, Behavior&, const Args&...)
+		{
+			FramePool::Deallocate(p);
 		}
 
-		// Jump to a state.
-		void Jump(const Context& ctx, const State& to)
+		Script				get_return_object() { return { std::coroutine_handle<ScriptPromise>::from_promise(*this) }; }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void				return_void() {}
+		void				unhandled_exception() { throw; }
+	};
+
+	// NextTick resumes a script on the next update, returns the context.
+	struct NextTick
+	{
+		ScriptPromise* p = nullptr;
+
+		bool		   await_ready() const { return false; }
+		void		   await_suspend(std::coroutine_handle<ScriptPromise> co) { p = &co.promise(), p->awaiting = ScriptPromise::Awaiting::Tick; }
+		const Context& await_resume() const { return *p->ctx; }
+	};
+
+	// Delay resumes a script on the update at which the accumulated ctx.delta reaches given duration,
+	// returns the context.
+	struct Delay
+	{
+		std::chrono::nanoseconds duration;
+		ScriptPromise*			 p = nullptr;
+
+		bool await_ready() const { return false; }
+		void await_suspend(std::coroutine_handle<ScriptPromise> co)
 		{
-			assert(m != nullptr);
-			int x = C(to);
-			if (m->top != -1)
-			{
-				Check(m->stack[m->top], x);
-				bt[m->stack[m->top--]]->OnTerminate(ctx);
-			}
-			m->stack[++m->top] = x;
-			bt[x]->OnEnter(ctx);
+			p = &co.promise(), p->awaiting = ScriptPromise::Awaiting::Delay, p->remaining = duration;
 		}
+		const Context& await_resume() const { return *p->ctx; }
+	};
 
-		// Pause current active state and push a new one.
-		void Push(const Context& ctx, const State& to)
+	// NextEvent resumes a script on an event of given id (or any event) passed to the state,
+	// returns the event.
+	struct NextEvent
+	{
+		unsigned int   id = 0;
+		bool		   matchAny = true;
+		ScriptPromise* p = nullptr;
+
+		NextEvent() = default;
+		explicit NextEvent(unsigned int id)
+			: id(id), matchAny(false) {}
+
+		bool await_ready() const { return false; }
+		void await_suspend(std::coroutine_handle<ScriptPromise> co)
 		{
-			assert(m != nullptr);
-			int x = C(to);
-			if (m->top != -1)
+			p = &co.promise(), p->awaiting = ScriptPromise::Awaiting::Event, p->eventId = id, p->matchAny = matchAny;
+		}
+		const Event& await_resume() const { return *p->event; }
+	};
+
+	//////////////////////
+	/// StateMachinePool
+	//////////////////////
+
+	// Handle identifies a state machine inside a pool.
+	using Handle = std::uint32_t;
+
+	// Forward declaration of ActorRuntime.
+	template <EnumClass State>
+	class ActorRuntime;
+
+	// Forward declaration of GuardProgram.
+	template <EnumClass State>
+	class GuardProgram;
+
+	// Forward declaration of RuleEngine.
+	template <EnumClass State>
+	class RuleEngine;
+
+	// Forward declaration of MarkovChain.
+	template <EnumClass State>
+	class MarkovChain;
+
+	// UpdateBudget limits a batched update, zero values mean unlimited.
+	struct UpdateBudget
+	{
+		// Max number of machines to update.
+		std::size_t maxMachines = 0;
+		// Max time to spend.
+		std::chrono::nanoseconds maxTime{ 0 };
+	};
+
+	// UpdateStats reports a budgeted batched update.
+	struct UpdateStats
+	{
+		// Number of machines updated.
+		std::size_t updated = 0;
+		// Number of active machines left in the round once the budget runs out, the next calls
+		// start with them.
+		std::size_t skipped = 0;
+		// Max number of ticks since the last update, among the updated and the skipped machines.
+		// Dormant machines aren't counted, and a machine woken up counts from the tick before.
+		unsigned long long maxStaleness = 0;
+	};
+
+	// StateMachinePool stores state machines contiguously and tracks the active ones.
+	// A dormant machine is excluded from batched updates, until it's woken up by an
+	// explicit Wake(handle), a timer set by Sleep(handle, ticks), or a transition.
+	// So the per-tick cost is proportional to the number of active machines only.
+	template <EnumClass State>
+	class StateMachinePool
+	{
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+
+	public:
+		StateMachinePool() = default;
+		StateMachinePool(const StateMachinePool&) = delete;
+
+		~StateMachinePool()
+		{
+			if (frames != nullptr)
+				for (Handle h = 0; h < machines.size(); ++h)
+					DestroyScripts(h);
+		}
+
+		// Creates a new (active) state machine, returns its handle.
+		// Handles of freed machines are reused.
+		// Throws a runtime_error if the pool would exceed the capacity of its inboxes or watches.
+		Handle New()
+		{
+			Handle h;
+			if (freed.empty() && inboxes != nullptr && machines.size() >= inboxCapacity)
+				throw std::runtime_error("pdfsm: pool exceeds inbox capacity " + std::to_string(inboxCapacity));
+			if (freed.empty() && watches != nullptr && machines.size() >= watchCapacity)
+				throw std::runtime_error("pdfsm: pool exceeds watch capacity " + std::to_string(watchCapacity));
+			if (!freed.empty())
 			{
-				Check(m->stack[m->top], x);
-				bt[m->stack[m->top]]->OnPause(ctx);
+				h = freed.back();
+				freed.pop_back();
+				machines[h].top = -1, machines[h].phase = Phase::None;
+				if (watches != nullptr)
+					watches[h].epoch.fetch_add(1);
+				for (auto& c : locks)
+					c[h / 64] &= ~(1ull << (h % 64));
+				for (auto& f : fields)
+					f[h] = 0;
+				for (auto& c : children)
+					c->Reset(h);
 			}
-			m->stack[++m->top] = x;
-			bt[x]->OnEnter(ctx);
+			else
+			{
+				h = static_cast<Handle>(machines.size());
+				machines.emplace_back();
+				if (queueCapacity > 0)
+					GrowQueues();
+				pos.push_back(Dormant);
+				wakeAt.push_back(0);
+				lastUpdate.push_back(0);
+				cur.push_back(-1);
+				mpos.push_back(-1);
+				for (auto& f : fields)
+					f.push_back(0);
+				for (auto& c : children)
+					c->Grow();
+				if (h % 64 == 0)
+					for (auto& c : locks)
+						c.push_back(0);
+				if (frames != nullptr)
+					scripts.resize(machines.size() * N);
+			}
+			pos[h] = Dormant;
+			Publish(h, -1);
+			Wake(h);
+			return h;
 		}
 
-		// Pop current active state and resume the previous paused state.
-		void Pop(const Context& ctx)
+		// Reserves storage for given number of machines.
+		// Machines never move in memory until the size exceeds the capacity reserved.
+		void Reserve(std::size_t capacity)
 		{
-			assert(m != nullptr);
-			assert(m->top >= 0);
-			bt[m->stack[m->top--]]->OnTerminate(ctx);
-			bt[m->stack[m->top]]->OnResume(ctx);
+			machines.reserve(capacity);
+			pos.reserve(capacity), wakeAt.reserve(capacity), lastUpdate.reserve(capacity);
+			cur.reserve(capacity), mpos.reserve(capacity);
+			for (auto& f : fields)
+				f.reserve(capacity);
+			for (auto& c : locks)
+				c.reserve((capacity + 63) / 64);
+			if (frames != nullptr)
+				scripts.reserve(capacity * N);
+			for (auto& c : children)
+				c->Reserve(capacity);
+		}
+
+		// Frees a state machine, its handle becomes invalid.
+		// Pending events are discarded. Under an ActorRuntime, it should be called from the
+		// controlling thread, and throws a runtime_error if the machine has events pending,
+		// which a worker may be processing.
+		void Free(Handle h)
+		{
+			assert(pos[h] != Freed);
+			if (runtime != nullptr && inboxes[h].pending.load(std::memory_order_acquire) != 0)
+				throw std::runtime_error("pdfsm: freeing machine " + std::to_string(h) + " having pending events");
+			if (inboxes != nullptr)
+				while (auto n = inboxes[h].events.Pop())
+					events->Release(n);
+			if (queueCapacity > 0)
+				for (std::size_t q = h * priorities; q < (h + 1) * priorities; ++q)
+					while (qsize[q] > 0)
+						Dequeue(q);
+			Remove(h);
+			Move(h, -1);
+			Unwatch(h);
+			if (frames != nullptr)
+				DestroyScripts(h);
+			pos[h] = Freed;
+			wakeAt[h] = 0;
+			freed.push_back(h);
 		}
+
+		StateMachine<State>&	   operator[](Handle h) { return machines[h]; }
+		const StateMachine<State>& operator[](Handle h) const { return machines[h]; }
+
+		// Returns the number of live machines.
+		std::size_t Size(void) const { return machines.size() - freed.size(); }
+		// Returns the number of active (not dormant) machines.
+		std::size_t NumActive(void) const { return active.size(); }
+		// Returns the number of batched updates performed on this pool.
+		unsigned long long Ticks(void) const { return tick; }
+
+		bool IsDormant(Handle h) const { return pos[h] < 0; }
+
+		// Returns the machines currently in given state, the order is unspecified.
+		// It's maintained by the transitions made by a handler bound to this pool.
+		const std::vector<Handle>& Members(State state) const { return members[static_cast<int>(state)]; }
+
+		// Enables locks of target states, transitions of a machine to its locked states are invalid
+		// whatever the table says, i.e. "cannot Jump while rooted". Locks of a state are stored
+		// as a bit column indexed by handles, and reusing a handle clears its locks, O(N).
+		void EnableLocks(void)
+		{
+			locks.assign(N, std::vector<std::uint64_t>((machines.size() + 63) / 64));
+			for (auto& c : locks)
+				c.reserve((machines.capacity() + 63) / 64);
+		}
+
+		bool HasLocks(void) const { return !locks.empty(); }
+		bool IsLocked(Handle h, State state) const { return Locked(h, static_cast<int>(state)); }
+
+		// Locks or unlocks given target state of machine h.
+		void SetLock(Handle h, State state, bool locked)
+		{
+			assert(!locks.empty());
+			auto& word = locks[static_cast<int>(state)][h / 64];
+			word = locked ? word | (1ull << (h % 64)) : word & ~(1ull << (h % 64));
+		}
+
+		// Locks or unlocks given target state of given machines, i.e. a team.
+		void SetLock(const std::vector<Handle>& handles, State state, bool locked)
+		{
+			for (auto h : handles)
+				SetLock(h, state, locked);
+		}
+
+		// Locks or unlocks given target state of all machines, a fill of the state's column.
+		void SetLock(State state, bool locked)
+		{
+			assert(!locks.empty());
+			auto& c = locks[static_cast<int>(state)];
+			std::fill(c.begin(), c.end(), locked ? ~0ull : 0);
+			// Bits beyond the machines stay clear for new machines.
+			if (locked && machines.size() % 64 != 0)
+				c.back() &= (1ull << (machines.size() % 64)) - 1;
+		}
+
+		// Puts a machine into dormant.
+		// If ticks > 0, it will be woken up after given number of batched updates.
+		// Machines run by an ActorRuntime are always dormant, it does nothing for them.
+		void Sleep(Handle h, unsigned ticks = 0)
+		{
+			assert(pos[h] != Freed);
+			if (runtime != nullptr)
+				return;
+			Remove(h);
+			wakeAt[h] = 0;
+			if (ticks > 0)
+			{
+				auto at = tick + ticks;
+				wakeAt[h] = at;
+				wheel[at % WheelSize].push_back({ h, at });
+			}
+		}
+
+		// Enables inboxes, so events can be posted to machines from any thread.
+		// Where capacity is the max number of machines, New fails beyond it, and event nodes are
+		// acquired from given pool.
+		void EnableInbox(EventPool& pool, std::size_t capacity)
+		{
+			assert(inboxes == nullptr && machines.size() <= capacity);
+			events = &pool, inboxCapacity = capacity;
+			inboxes.reset(new Inbox[capacity]);
+			for (std::size_t i = 0; i < capacity; ++i)
+				inboxes[i].handle = static_cast<Handle>(i);
+		}
+
+		// Posts an event to machine h, safe to call from any thread, wait-free except for
+		// acquiring a node from the event pool. The machine will be woken up if it's dormant,
+		// and the event will be passed to its current state's OnEvent right before BeforeUpdate.
+		// Returns false if the event pool is exhausted.
+		// Under an ActorRuntime, it's the same as posting to the runtime.
+		bool Post(Handle h, Event event)
+		{
+			assert(inboxes != nullptr && h < inboxCapacity);
+			if (runtime != nullptr)
+				return runtime->Post(h, std::move(event));
+			auto n = events->Acquire();
+			if (n == nullptr)
+				return false;
+			n->event = std::move(event);
+			auto& inbox = inboxes[h];
+			inbox.events.Push(n);
+			if (!inbox.ready.exchange(true, std::memory_order_acq_rel))
+				ready.Push(&inbox);
+			return true;
+		}
+
+		// Enables event queues, so events can be queued to machines with priorities and coalescing.
+		// Each machine has a fixed-capacity ring buffer for each priority.
+		// Events posted to inboxes are passed through the queues as well.
+		void EnableQueue(std::size_t capacity, unsigned int nPriorities = 1)
+		{
+			assert(queueCapacity == 0 && capacity > 0 && nPriorities > 0);
+			queueCapacity = capacity, priorities = nPriorities;
+			GrowQueues();
+		}
+
+		// Declares the policy of events of given id.
+		void SetEventPolicy(unsigned int eventId, EventPolicy policy)
+		{
+			assert(policy.priority < priorities);
+			if (eventId >= policies.size())
+				policies.resize(eventId + 1);
+			policies[eventId] = std::move(policy);
+		}
+
+		// Queues an event to machine h by its policy, wakes up the machine if it's dormant.
+		// The event will be passed to its current state's OnEvent right before BeforeUpdate,
+		// more urgent ones first. Returns false if the ring buffer is full, and then the
+		// event is not moved.
+		bool Enqueue(Handle h, Event&& event)
+		{
+			assert(queueCapacity > 0);
+			static const EventPolicy fallback;
+			const auto& policy = event.id < policies.size() ? policies[event.id] : fallback;
+			auto		q = h * priorities + policy.priority;
+			auto*		ring = &queue[q * queueCapacity];
+			Wake(h);
+			if (policy.coalescing != Coalescing::None)
+			{
+				for (std::size_t i = 0; i < qsize[q]; ++i)
+				{
+					auto& queued = ring[(qhead[q] + i) % queueCapacity];
+					if (queued.id != event.id)
+						continue;
+					if (policy.coalescing == Coalescing::Replace)
+						queued = std::move(event);
+					else if (policy.coalescing == Coalescing::Accumulate)
+						policy.accumulate(queued, event);
+					return true;
+				}
+			}
+			if (qsize[q] == queueCapacity)
+				return false;
+			ring[(qhead[q] + qsize[q]++) % queueCapacity] = std::move(event);
+			return true;
+		}
+
+		// Returns the number of events queued to machine h.
+		std::size_t QueueSize(Handle h) const
+		{
+			std::size_t n = 0;
+			for (std::size_t q = h * priorities; q < (h + 1) * priorities; ++q)
+				n += qsize[q];
+			return n;
+		}
+
+		// Awaiter is the awaitable returned by AsyncWaitFor.
+		class Awaiter
+		{
+		public:
+			bool  await_ready() { return epoch % 2 == 0 && pool.Reached(h, states, bits, result); }
+			bool  await_suspend(std::coroutine_handle<> co);
+			State await_resume() const
+			{
+				if (result < 0)
+					throw std::runtime_error("pdfsm: waiting for a freed machine " + std::to_string(h));
+				return static_cast<State>(result);
+			}
+
+		private:
+			StateMachinePool&		pool;
+			Handle					h;
+			std::bitset<N>			states;
+			std::uint64_t			bits;
+			std::uint32_t			epoch;
+			int						result = -1;
+			std::coroutine_handle<> co;
+
+			Awaiter(StateMachinePool& pool, Handle h, std::bitset<N> states, std::uint64_t bits, std::uint32_t epoch)
+				: pool(pool), h(h), states(states), bits(bits), epoch(epoch) {}
+
+			friend StateMachinePool;
+		};
+
+		// Enables scripts (see ScriptBehavior), whose frames are allocated from a pool of
+		// given capacity, each no larger than frameSize bytes.
+		void EnableScripts(std::size_t frameSize, std::size_t capacity)
+		{
+			assert(frames == nullptr);
+			frames = std::make_unique<FramePool>(frameSize, capacity);
+			scripts.reserve(machines.capacity() * N);
+			scripts.resize(machines.size() * N);
+		}
+
+		// Enables given number of numeric fields for each machine, i.e. read by guards (see GuardProgram).
+		// Each field is stored as a column indexed by handles, zero for new machines.
+		void EnableFields(std::size_t count)
+		{
+			fields.assign(count, std::vector<float>(machines.size()));
+			for (auto& f : fields)
+				f.reserve(machines.capacity());
+		}
+
+		std::size_t NumFields(void) const { return fields.size(); }
+
+		// Returns the column of field i, invalidated when the pool grows.
+		float* Field(std::size_t i) { return fields[i].data(); }
+		float& Field(std::size_t i, Handle h) { return fields[i][h]; }
+
+		// Enables child machines of enum ChildState for each machine, for the sub-machine states
+		// (see SubMachineBehavior). They're stored as a column indexed by handles.
+		template <EnumClass ChildState>
+		void EnableChildren(void)
+		{
+			assert(FindChildren(&TypeKey<ChildState>) == nullptr);
+			auto c = std::make_unique<ChildColumn<ChildState>>();
+			c->Reserve(machines.capacity());
+			c->machines.resize(machines.size());
+			children.push_back(std::move(c));
+		}
+
+		bool HasChildren(const void* key) const { return FindChildren(key) != nullptr; }
+
+		// Returns the child machine of enum ChildState of machine h, requires it's enabled.
+		template <EnumClass ChildState>
+		StateMachine<ChildState>& Child(Handle h)
+		{
+			auto c = FindChildren(&TypeKey<ChildState>);
+			assert(c != nullptr);
+			return static_cast<ChildColumn<ChildState>*>(c)->machines[h];
+		}
+
+		// Returns the number of script frames alive.
+		std::size_t NumScripts(void) const { return frames == nullptr ? 0 : frames->Capacity() - frames->NumFree(); }
+
+		// Enables waiting for machines to reach states, from any thread.
+		// Where capacity is the max number of machines, New fails beyond it.
+		void EnableWaitFor(std::size_t capacity)
+		{
+			assert(watches == nullptr && machines.size() <= capacity);
+			watchCapacity = capacity;
+			watches.reset(new Watch[capacity]);
+			for (Handle h = 0; h < machines.size(); ++h)
+				if (pos[h] == Freed)
+					watches[h].epoch.store(1);
+				else if (cur[h] >= 0)
+					watches[h].state.store(cur[h]);
+		}
+
+		// Blocks until machine h is in one of given states, returns the state reached.
+		// Safe to call from any thread, the thread sleeps on an atomic wait, and it's
+		// notified only by the transitions to the states it waits for, or freeing the machine.
+		// Throws a runtime_error if the machine is freed, before or meanwhile.
+		template <std::same_as<State>... States>
+		State WaitFor(Handle h, States... targets)
+		{
+			assert(watches != nullptr && h < watchCapacity);
+			std::bitset<N> states;
+			(states.set(static_cast<int>(targets)), ...);
+			auto  bits = (Bit(static_cast<int>(targets)) | ...);
+			auto& w = watches[h];
+			auto  epoch = w.epoch.load();
+			int	  result;
+			while (true)
+			{
+				auto seq = w.seq.load();
+				if (epoch % 2 == 1 || w.epoch.load() != epoch)
+					throw std::runtime_error("pdfsm: waiting for a freed machine " + std::to_string(h));
+				if (Reached(h, states, bits, result))
+					return static_cast<State>(result);
+				// Re-registers if the bits were consumed by a transition meanwhile.
+				if ((w.wanted.load() & bits) == bits)
+					w.seq.wait(seq);
+			}
+		}
+
+		// Returns an awaitable, which resumes the awaiting coroutine once machine h is in one
+		// of given states, on the thread making the transition, right after the OnEnter (or OnResume).
+		// The result of co_await is the state reached. If the machine is freed, before or meanwhile,
+		// the coroutine resumes (on the thread freeing it) and co_await throws a runtime_error.
+		template <std::same_as<State>... States>
+		Awaiter AsyncWaitFor(Handle h, States... targets)
+		{
+			assert(watches != nullptr && h < watchCapacity);
+			std::bitset<N> states;
+			(states.set(static_cast<int>(targets)), ...);
+			return Awaiter(*this, h, states, (Bit(static_cast<int>(targets)) | ...), watches[h].epoch.load());
+		}
+
+		// Wakes up a dormant machine, O(1).
+		// Machines run by an ActorRuntime stay dormant, they are scheduled by their events instead.
+		void Wake(Handle h)
+		{
+			wakeAt[h] = 0;
+			if (pos[h] != Dormant || runtime != nullptr)
+				return;
+			lastUpdate[h] = tick > 0 ? tick - 1 : 0;
+			pos[h] = static_cast<int>(active.size());
+			active.push_back(h);
+		}
+
+	private:
+		// Special values of pos[h].
+		static constexpr int Dormant = -1, Freed = -2;
+		// Number of slots of the timing wheel.
+		static constexpr int WheelSize = 256;
+
+		struct Timer
+		{
+			Handle			   h;
+			unsigned long long at;
+		};
+
+		// Watch publishes the current state of a machine to the waiters.
+		struct Watch
+		{
+			// Current state, -1 for none.
+			std::atomic<int> state = -1;
+			// Bits (state % 64) of the states being waited for.
+			std::atomic<std::uint64_t> wanted = 0;
+			// Bumped on each notification, blocking waiters wait on it.
+			std::atomic<std::uint32_t> seq = 0;
+			// Bumped on freeing the machine and reusing its handle, so it's odd while freed.
+			std::atomic<std::uint32_t> epoch = 0;
+			// Suspended coroutines waiting for the machine, guarded by mutex.
+			std::vector<Awaiter*> awaiters;
+			std::mutex			  mutex;
+		};
+
+		std::vector<StateMachine<State>> machines;
+		// pos[h] is the position of machine h in the active list, or Dormant, or Freed.
+		std::vector<int> pos;
+		// Dense list of active handles, and the list of free handles.
+		std::vector<Handle> active, freed;
+		// wakeAt[h] is the tick machine h should be woken at, 0 for none.
+		// A timer in the wheel is valid only if it equals to the machine's wakeAt.
+		std::vector<unsigned long long> wakeAt;
+		// Hashed timing wheel, a timer scheduled at tick t lives in slot t % WheelSize.
+		std::vector<Timer> wheel[WheelSize];
+		// lastUpdate[h] is the tick machine h was updated at, a machine woken up counts as
+		// updated on the tick before, so only the updated ones are at the current tick.
+		std::vector<unsigned long long> lastUpdate;
+		// Count of batched updates.
+		unsigned long long tick = 0;
+		// Position in the active list where the next budgeted update resumes from.
+		std::size_t cursor = 0;
+		// Inboxes, enabled by EnableInbox.
+		std::unique_ptr<Inbox[]> inboxes;
+		std::size_t				 inboxCapacity = 0;
+		EventPool*				 events = nullptr;
+		// Queue of inboxes having new events.
+		MpscQueue<Inbox> ready;
+		// Event queues, enabled by EnableQueue.
+		// Ring q = h * priorities + priority is queue[q * queueCapacity ...],
+		// starting at qhead[q], of qsize[q] events.
+		std::size_t				   queueCapacity = 0;
+		unsigned int			   priorities = 0;
+		std::vector<Event>		   queue;
+		std::vector<std::uint32_t> qhead, qsize;
+		std::vector<EventPolicy>   policies;
+		// Membership index, members[s] lists the machines currently in state s.
+		std::vector<Handle> members[N];
+		// cur[h] is the current state of machine h, -1 for none.
+		// mpos[h] is the position of machine h in members[cur[h]].
+		std::vector<int> cur, mpos;
+		// Watches, enabled by EnableWaitFor.
+		std::unique_ptr<Watch[]> watches;
+		std::size_t				 watchCapacity = 0;
+		// Field columns, enabled by EnableFields.
+		std::vector<std::vector<float>> fields;
+		// The ActorRuntime running the machines, if any, then they make transitions on
+		// worker threads, and the membership index is guarded by memberMutex.
+		ActorRuntime<State>* runtime = nullptr;
+		std::mutex			 memberMutex;
+
+		// Child machine columns, enabled by EnableChildren, one for each child enum.
+		struct Children
+		{
+			const void* key;
+
+			explicit Children(const void* key)
+				: key(key) {}
+			virtual ~Children() = default;
+			virtual void Grow(void) = 0;
+			virtual void Reserve(std::size_t capacity) = 0;
+			virtual void Reset(Handle h) = 0;
+		};
+
+		template <EnumClass ChildState>
+		struct ChildColumn : Children
+		{
+			std::vector<StateMachine<ChildState>> machines;
+
+			ChildColumn()
+				: Children(&TypeKey<ChildState>) {}
+			void Grow(void) override { machines.emplace_back(); }
+			void Reserve(std::size_t capacity) override { machines.reserve(capacity); }
+			void Reset(Handle h) override { machines[h] = {}; }
+		};
+
+		std::vector<std::unique_ptr<Children>> children;
+
+		Children* FindChildren(const void* key) const
+		{
+			for (auto& c : children)
+				if (c->key == key)
+					return c.get();
+			return nullptr;
+		}
+
+		// Lock columns, enabled by EnableLocks, bit h of locks[s] is set if state s is locked for machine h.
+		std::vector<std::vector<std::uint64_t>> locks;
+
+		bool Locked(Handle h, int s) const { return !locks.empty() && (locks[s][h / 64] >> (h % 64) & 1); }
+
+		// Script frames, enabled by EnableScripts.
+		// scripts[h * N + s] is the frame of state s of machine h.
+		std::unique_ptr<FramePool>						  frames;
+		std::vector<std::coroutine_handle<ScriptPromise>> scripts;
+
+		// Destroys the script frames of machine h.
+		void DestroyScripts(Handle h)
+		{
+			for (auto s = h * N; s < (h + 1) * N; ++s)
+				if (scripts[s])
+					scripts[s].destroy(), scripts[s] = nullptr;
+		}
+
+		static std::uint64_t Bit(int s) { return std::uint64_t(1) << (s % 64); }
+
+		// Registers the wanted bits of machine h, and checks if it's in given states.
+		bool Reached(Handle h, const std::bitset<N>& states, std::uint64_t bits, int& result)
+		{
+			auto& w = watches[h];
+			w.wanted.fetch_or(bits);
+			result = w.state.load();
+			return result >= 0 && states[result];
+		}
+
+		// Publishes state s of machine h, safe to call from any thread.
+		// Costs a store and a load if nobody waits for s.
+		void Publish(Handle h, int s)
+		{
+			if (watches == nullptr)
+				return;
+			assert(h < watchCapacity);
+			auto& w = watches[h];
+			w.state.store(s);
+			if (s < 0 || (w.wanted.load() & Bit(s)) == 0)
+				return;
+			// Blocking waiters not satisfied will register again.
+			w.wanted.exchange(0);
+			w.seq.fetch_add(1);
+			w.seq.notify_all();
+			std::vector<Awaiter*> due;
+			{
+				std::lock_guard<std::mutex> lock(w.mutex);
+				for (std::size_t i = 0; i < w.awaiters.size();)
+				{
+					auto a = w.awaiters[i];
+					if (a->states[s])
+					{
+						a->result = s;
+						due.push_back(a);
+						w.awaiters[i] = w.awaiters.back();
+						w.awaiters.pop_back();
+						continue;
+					}
+					w.wanted.fetch_or(a->bits);
+					++i;
+				}
+			}
+			for (auto a : due)
+				a->co.resume();
+		}
+
+		// Fails the waiters of machine h being freed, the blocking ones throw on waking up,
+		// and the awaiting coroutines are resumed to throw.
+		void Unwatch(Handle h)
+		{
+			if (watches == nullptr)
+				return;
+			auto& w = watches[h];
+			w.state.store(-1);
+			w.epoch.fetch_add(1);
+			w.wanted.store(0);
+			w.seq.fetch_add(1);
+			w.seq.notify_all();
+			std::vector<Awaiter*> due;
+			{
+				std::lock_guard<std::mutex> lock(w.mutex);
+				due.swap(w.awaiters);
+			}
+			for (auto a : due)
+				a->result = -1, a->co.resume();
+		}
+
+		// Moves machine h to the members of state s (-1 for none), O(1).
+		void Move(Handle h, int s)
+		{
+			std::unique_lock<std::mutex> lock(memberMutex, std::defer_lock);
+			if (runtime != nullptr)
+				lock.lock();
+			if (cur[h] == s)
+				return;
+			if (cur[h] >= 0)
+			{
+				auto& v = members[cur[h]];
+				auto  last = v.back();
+				v[mpos[h]] = last, mpos[last] = mpos[h];
+				v.pop_back();
+			}
+			cur[h] = s, mpos[h] = -1;
+			if (s >= 0)
+			{
+				mpos[h] = static_cast<int>(members[s].size());
+				members[s].push_back(h);
+			}
+		}
+
+		void GrowQueues(void)
+		{
+			queue.resize(machines.size() * priorities * queueCapacity);
+			qhead.resize(machines.size() * priorities, 0);
+			qsize.resize(machines.size() * priorities, 0);
+		}
+
+		// Pops the front event of ring q.
+		Event Dequeue(std::size_t q)
+		{
+			auto e = std::move(queue[q * queueCapacity + qhead[q]]);
+			qhead[q] = (qhead[q] + 1) % queueCapacity, --qsize[q];
+			return e;
+		}
+
+		// Removes a machine from the active list, O(1).
+		// Machines before the cursor are updated in the current round of updates,
+		// so a hole there is filled by the last of them, keeping the rest of the round intact.
+		void Remove(Handle h)
+		{
+			int i = pos[h];
+			if (i < 0)
+				return;
+			if (static_cast<std::size_t>(i) < cursor)
+			{
+				auto c = active[--cursor];
+				active[i] = c, pos[c] = i;
+				i = static_cast<int>(cursor);
+			}
+			auto last = active.back();
+			active[i] = last, pos[last] = i;
+			active.pop_back();
+			pos[h] = Dormant;
+		}
+
+		// Advances a tick, wakes up machines whose timers are due, or having new events.
+		void Advance(void)
+		{
+			if (inboxes != nullptr)
+				while (auto inbox = ready.Pop())
+				{
+					// Synchronizes with the posting threads.
+					inbox->ready.exchange(false, std::memory_order_acq_rel);
+					if (pos[inbox->handle] != Freed)
+						Wake(inbox->handle);
+				}
+			auto& slot = wheel[++tick % WheelSize];
+			for (std::size_t i = 0; i < slot.size();)
+			{
+				auto t = slot[i];
+				if (t.at != tick)
+				{
+					++i; // belongs to a later round
+					continue;
+				}
+				if (wakeAt[t.h] == tick)
+					Wake(t.h);
+				slot[i] = slot.back();
+				slot.pop_back();
+			}
+		}
+
+		friend class StateMachineHandler<State>;
+		friend class ActorRuntime<State>;
+		friend class GuardProgram<State>;
+		friend class RuleEngine<State>;
+		friend class MarkovChain<State>;
+		template <auto>
+		friend class ScriptBehavior;
+	};
+
+	template <EnumClass State>
+	bool StateMachinePool<State>::Awaiter::await_suspend(std::coroutine_handle<> c)
+	{
+		auto&						w = pool.watches[h];
+		std::lock_guard<std::mutex> lock(w.mutex);
+		// Freed before or meanwhile, resumes to throw.
+		if (epoch % 2 == 1 || w.epoch.load() != epoch)
+			return result = -1, false;
+		if (pool.Reached(h, states, bits, result))
+			return false;
+		co = c;
+		w.awaiters.push_back(this);
+		return true;
+	}
+
+	/////////////////////////
+	/// StateMachineHandler
+	/////////////////////////
+
+	template <EnumClass State>
+	class StateMachineHandler
+	{
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+		// (Compressed) transition table, tt[from][to]
+		std::bitset<N> tt[N];
+		// Targets of wildcard rules from any state.
+		std::bitset<N> any;
+		// Targets of the other wildcard rules, and the states each of them is admitted from,
+		// sources[slot[to]][from], taking N bits per such target.
+		std::bitset<N>				ruled;
+		std::vector<int>			slot;
+		std::vector<std::bitset<N>> sources;
+		// All-pairs routes, hops[from * N + to] is the next state from state from to state to,
+		// and dists[from * N + to] is the distance, Unreachable if not reachable.
+		// Computed on the first query, since they take N * N space.
+		using Hop = std::conditional_t<(N < 255), std::uint8_t, std::uint16_t>;
+		static constexpr Hop	 Unreachable = std::numeric_limits<Hop>::max();
+		mutable std::vector<Hop> hops, dists;
+		// Behavior pointers array.
+		// bt[state enum integer] => raw pointer to the behavior instance.
+		IStateBehavior<State>* bt[N];
+		// Currently processing fsm, and the reference to its stack, or the stack of the current
+		// region if it's a regional one.
+		StateMachine<State>*		   fsm = nullptr;
+		std::optional<StackRef<State>> ref;
+		StackRef<State>*			   m = nullptr;
+		// Regions of the currently processing fsm, if it's a regional one: the tops, the stacks,
+		// the first state of each region, and the region of each state.
+		int*	   tops = nullptr;
+		int*	   stacks = nullptr;
+		const int* first = nullptr;
+		const int* region = nullptr;
+		int		   nRegions = 0, focused = 0;
+		// Fields of asynchronous transitions of regions, never set.
+		Phase noPhase = Phase::None;
+		int	  noTarget = -1;
+		float noProgress = 0;
+		// The pool the currently processing fsm belongs to, if any.
+		StateMachinePool<State>* pool = nullptr;
+		// Handle of the currently processing fsm in the pool.
+		Handle handle = 0;
+		// The pool publishing the currently processing fsm's state to waiters, if any.
+		StateMachinePool<State>* watched = nullptr;
+		// Behaviors owned by this handler, if any.
+		std::vector<std::unique_ptr<IStateBehavior<State>>> owned;
+		// State hierarchy, if any, and the transition table and wildcard sources before
+		// inheriting transitions.
+		const Hierarchy<State>*			  hierarchy = nullptr;
+		std::unique_ptr<std::bitset<N>[]> base;
+		std::vector<std::bitset<N>>		  baseSources;
+		// Locates the child machines of the currently processing fsm, if it's a nested one.
+		void* (*locate)(StateMachine<State>*, const void*) = nullptr;
+		// Keys of the child enums of the sub-machine states, which need a nested fsm, or a pool
+		// having the child machines enabled.
+		std::vector<const void*> childKeys;
+		// Frames of the currently processing fsm, if it carries data, and the size of a frame.
+		std::byte*	frames = nullptr;
+		std::size_t frameSize = 0;
+		// Max size of the data of the states, which needs a data fsm of frames no smaller.
+		std::size_t dataSize = 0;
+		// Entry data passed to Jump or Push, its type key, the state to enter, and whether
+		// it should be moved.
+		void*		entry = nullptr;
+		const void* entryKey = nullptr;
+		int			entryState = -1;
+		bool		entryMoved = false;
+		// States that can't be entered without entry data.
+		std::bitset<N> needsEntry;
+
+	protected:
+		// throws a runtime_error if the transition is invalid.
+		inline bool Valid(int from, int to) const { return tt[from][to] || any[to] || (ruled[to] && sources[slot[to]][from]); }
+		inline void Check(int from, int to) const
+		{
+			if (!Valid(from, to))
+				throw std::runtime_error("pdfsm: invalid jump from " + std::to_string(from) + " to " + std::to_string(to));
+			if (pool != nullptr && pool->Locked(handle, to))
+				throw std::runtime_error("pdfsm: locked jump from " + std::to_string(from) + " to " + std::to_string(to));
+		}
+		inline int C(State state) const { return static_cast<int>(state); }
+		// throws a runtime_error if state to needs entry data, but none is given.
+		inline void CheckEntry(int to) const
+		{
+			if (needsEntry[to] && (entry == nullptr || entryState != to))
+				throw std::runtime_error("pdfsm: missing entry data for state " + std::to_string(to));
+		}
+		// throws a runtime_error if there're sub-machine states, but the fsm isn't a nested one.
+		inline void CheckFlat(void) const
+		{
+			if (!childKeys.empty())
+				throw std::runtime_error("pdfsm: sub-machine states need a nested fsm");
+		}
+		// throws a runtime_error if the data of any state doesn't fit in frames of given size,
+		// zero for an fsm not carrying data.
+		inline void CheckFrames(std::size_t size) const
+		{
+			if (dataSize > size)
+				throw std::runtime_error("pdfsm: state data of " + std::to_string(dataSize) + " bytes needs a data fsm of larger frames");
+		}
+		// throws a runtime_error if the child machines of any sub-machine state is missing.
+		inline void CheckChildren(StateMachine<State>* fsm, StateMachinePool<State>* p) const
+		{
+			for (auto key : childKeys)
+				if (p != nullptr ? !p->HasChildren(key) : locate(fsm, key) == nullptr)
+					throw std::runtime_error("pdfsm: missing child machines of a sub-machine state");
+		}
+
+		// Setup this state machine by a behaviors table and a transitions table.
+		void Setup(const auto& behaviors, const TransitionTable<State>& transitions, const WildcardTable<State>& wildcards)
+		{
+			// Setup behaviors.
+			for (auto& b : behaviors)
+			{
+				auto state = b->StateValue();
+				bt[C(state)] = b.get();
+				b->BindHandler(this);
+				b->OnSetup();
+				needsEntry[C(state)] = !b->AcceptsEntry(nullptr);
+			}
+
+			// Setup transitions.
+			for (const auto& t : transitions)
+				for (const auto& to : t.targets)
+				{
+					tt[C(t.from)][C(to)] = 1;
+				}
+
+			// Setup wildcards, each target of a rule (other than from any) gets a mask of the
+			// states it's admitted from, so checking a transition is O(1).
+			for (const auto& w : wildcards)
+			{
+				if (w.from.size() == 0 && w.except.size() == 0)
+				{
+					for (const auto& to : w.targets)
+						any[C(to)] = 1;
+					continue;
+				}
+				std::bitset<N> admitted;
+				for (const auto& x : w.from.size() == 0 ? w.except : w.from)
+					admitted[C(x)] = 1;
+				if (w.from.size() == 0)
+					admitted.flip();
+				if (slot.empty())
+					slot.assign(N, -1);
+				for (const auto& to : w.targets)
+				{
+					if (!ruled[C(to)])
+						ruled[C(to)] = 1, slot[C(to)] = static_cast<int>(sources.size()), sources.emplace_back();
+					sources[slot[C(to)]] |= admitted;
+				}
+			}
+		}
+
+		// Computes the next-hop and distance tables if not yet, by a BFS from each state,
+		// O(N * (N + E)).
+		void Route(void) const
+		{
+			static_assert(N < std::numeric_limits<std::uint16_t>::max(), "too many states for routes");
+			if (!hops.empty())
+				return;
+			std::vector<std::vector<int>> adj(N);
+			for (int s = 0; s < N; ++s)
+				for (int to = 0; to < N; ++to)
+					if (Valid(s, to) && to != s)
+						adj[s].push_back(to);
+			hops.assign(N * N, Unreachable), dists.assign(N * N, Unreachable);
+			std::vector<int> queue(N);
+			for (int s = 0; s < N; ++s)
+			{
+				Hop* hop = &hops[s * N];
+				Hop* dist = &dists[s * N];
+				int	 head = 0, tail = 0;
+				hop[s] = static_cast<Hop>(s), dist[s] = 0, queue[tail++] = s;
+				while (head < tail)
+				{
+					int u = queue[head++];
+					for (int v : adj[u])
+						if (dist[v] == Unreachable)
+						{
+							hop[v] = u == s ? static_cast<Hop>(v) : hop[u];
+							dist[v] = dist[u] + 1, queue[tail++] = v;
+						}
+				}
+			}
+		}
+
+	public:
+		StateMachineHandler(const auto& behaviors, const auto& transitions, const WildcardTable<State>& wildcards = {})
+		{
+			Setup(behaviors, transitions, wildcards);
+		}
+
+		// Takes the ownership of given behaviors, i.e. a handler for each worker thread.
+		StateMachineHandler(std::vector<std::unique_ptr<IStateBehavior<State>>>&& behaviors, const auto& transitions,
+			const WildcardTable<State>& wildcards = {})
+			: owned(std::move(behaviors))
+		{
+			Setup(owned, transitions, wildcards);
+		}
+
+		// Makes states hierarchical by given parent relation, which should outlive this handler.
+		// Then a state inherits the transitions of its ancestors, a transition terminates
+		// and enters the states along the paths below their least common ancestor, and
+		// BeforeUpdate and Update bubble from the active state up to the root.
+		// Setting another hierarchy replaces the inherited transitions of the previous one.
+		// Throws a runtime_error if there're states with data, see DataBehavior.
+		void SetHierarchy(const Hierarchy<State>& h)
+		{
+			if (dataSize > 0)
+				throw std::runtime_error("pdfsm: state data in a hierarchy");
+			if (base == nullptr)
+				base = std::make_unique<std::bitset<N>[]>(N), std::copy(tt, tt + N, base.get()), baseSources = sources;
+			else
+				std::copy(base.get(), base.get() + N, tt), sources = baseSources;
+			hierarchy = &h;
+			for (int s = 0; s < N; ++s)
+				for (int d = 0; d < h.Depth(s); ++d)
+				{
+					tt[s] |= tt[h.Ancestor(s, d)];
+					// A wildcard rule admitting a state admits its substates too.
+					for (auto& admitted : sources)
+						admitted[s] = admitted[s] || admitted[h.Ancestor(s, d)];
+				}
+			hops.clear(), dists.clear();
+		}
+
+		// Sets current handling fsm.
+		void SetHandlingFsm(StateMachine<State>& fsm, const Context& ctx)
+		{
+			CheckFlat(), CheckFrames(0);
+			Bind(fsm), pool = nullptr, watched = nullptr, locate = nullptr, frames = nullptr;
+			if (m->top == -1)
+				Jump(ctx, static_cast<State>(0));
+		}
+
+		// Sets current handling fsm to one carrying data, the data of the states are stored
+		// in its stack frames.
+		template <std::size_t FrameSize>
+		void SetHandlingFsm(DataStateMachine<State, FrameSize>& fsm, const Context& ctx)
+		{
+			CheckFlat(), CheckFrames(DataStateMachine<State, FrameSize>::Stride);
+			Bind(fsm), pool = nullptr, watched = nullptr, locate = nullptr;
+			frames = &fsm.data[0][0], frameSize = DataStateMachine<State, FrameSize>::Stride;
+			if (m->top == -1)
+				Jump(ctx, static_cast<State>(0));
+		}
+
+		// Sets current handling fsm to a nested one, its child machines are handled by the
+		// sub-machine states.
+		template <EnumClass... Children>
+		void SetHandlingFsm(NestedStateMachine<State, Children...>& fsm, const Context& ctx)
+		{
+			locate = &NestedStateMachine<State, Children...>::Locate;
+			CheckChildren(&fsm, nullptr), CheckFrames(0);
+			Bind(fsm), pool = nullptr, watched = nullptr, frames = nullptr;
+			if (m->top == -1)
+				Jump(ctx, static_cast<State>(0));
+		}
+
+		// Sets current handling fsm to the one in given pool.
+		// For a handler with sub-machine states, the pool should have their child machines enabled.
+		// Machines in a pool don't carry data, a handler with data states can't handle them.
+		void SetHandlingFsm(StateMachinePool<State>& p, Handle h, const Context& ctx)
+		{
+			if (!childKeys.empty())
+				CheckChildren(nullptr, &p);
+			CheckFrames(0);
+			Bind(p[h]), pool = &p, watched = &p, handle = h, locate = nullptr, frames = nullptr;
+			if (m->top == -1)
+				Jump(ctx, static_cast<State>(0));
+		}
+
+		// Sets current handling fsm to a regional one, each region not started enters its first state.
+		// Updates and events go to all regions in a single pass, a transition to a state goes to
+		// its region, and the other calls go to the current region (see Focus), the first one initially.
+		// The current region is kept by transitions of other regions, i.e. made by hooks.
+		template <State... Firsts>
+		void SetHandlingFsm(RegionalStateMachine<State, Firsts...>& fsm, const Context& ctx)
+		{
+			using R = RegionalStateMachine<State, Firsts...>;
+			CheckFlat(), CheckFrames(0);
+			pool = nullptr, watched = nullptr, locate = nullptr, frames = nullptr, this->fsm = nullptr;
+			tops = fsm.top, stacks = fsm.stack, first = R::first, region = R::region.r, nRegions = R::K;
+			for (int r = 0; r < nRegions; ++r)
+			{
+				Focus(r);
+				if (m->top == -1)
+					Jump(ctx, static_cast<State>(first[r]));
+			}
+			Focus(0);
+		}
+
+		// Clears current handling fsm.
+		void ClearHandlingFsm(void)
+		{
+			m = nullptr, fsm = nullptr, tops = nullptr, pool = nullptr, watched = nullptr, locate = nullptr, frames = nullptr;
+		}
+
+		// Makes the region of given state the current region of a regional fsm.
+		void Focus(State state)
+		{
+			assert(tops != nullptr);
+			Focus(region[C(state)]);
+		}
+
+		// Puts current handling fsm into dormant, requires it's handled within a pool.
+		// If ticks > 0, it will be woken up after given number of batched updates.
+		// A transition wakes up the fsm as well. Does nothing under an ActorRuntime.
+		void Sleep(unsigned ticks = 0)
+		{
+			assert(pool != nullptr);
+			pool->Sleep(handle, ticks);
+		}
+
+		// Returns true if the transition is valid by the transition table (and wildcards),
+		// regardless of the locks of machines.
+		bool IsValid(State from, State to) const { return Valid(C(from), C(to)); }
+
+		// Returns the valid targets from given state, by the transition table (and wildcards).
+		std::bitset<N> Targets(State from) const
+		{
+			auto t = tt[C(from)] | any;
+			if (ruled.any())
+				for (int to = 0; to < N; ++to)
+					if (ruled[to] && sources[slot[to]][C(from)])
+						t[to] = 1;
+			return t;
+		}
+
+		// Returns true if given state is reachable from another, by a route of valid transitions, O(1).
+		// The routes are computed on the first call of these, and JumpPath and PushPath.
+		bool IsReachable(State from, State to) const
+		{
+			Route();
+			return dists[C(from) * N + C(to)] != Unreachable;
+		}
+
+		// Returns the length of the shortest route between given states, -1 if not reachable.
+		int Distance(State from, State to) const
+		{
+			Route();
+			auto d = dists[C(from) * N + C(to)];
+			return d == Unreachable ? -1 : d;
+		}
+
+		// Returns the next state along the shortest route between given states, requires it's reachable.
+		State NextHop(State from, State to) const
+		{
+			assert(IsReachable(from, to));
+			Route();
+			return static_cast<State>(hops[C(from) * N + C(to)]);
+		}
+
+		// Returns current active state.
+		State Top(void) const
+		{
+			assert(m != nullptr);
+			assert(m->top >= 0);
+			return static_cast<State>(m->stack[m->top]);
+		}
+
+		// Returns the phase of the asynchronous transition in progress, Phase::None for none.
+		Phase CurrentPhase(void) const
+		{
+			assert(m != nullptr);
+			return m->phase;
+		}
+
+		// Returns the progress of current phase, reported by OnExiting or OnEntering.
+		float Progress(void) const
+		{
+			assert(m != nullptr);
+			return m->progress;
+		}
+
+		// Propagates ticking to current active state.
+		// During an asynchronous transition, it advances the transition instead.
+		void Update(const Context& ctx)
+		{
+			assert(m != nullptr);
+			if (tops != nullptr)
+			{
+				for (int r = 0; r < nRegions; ++r)
+					Focus(r), Tick(ctx);
+				return;
+			}
+			if (pool != nullptr && (pool->inboxes != nullptr || pool->queueCapacity > 0))
+				Drain(ctx);
+			Tick(ctx);
+		}
+
+		// Propagates ticking to all active fsms in given pool.
+		// Dormant fsms are skipped, without any cost.
+		void Update(StateMachinePool<State>& p, const Context& ctx)
+		{
+			p.Advance();
+			// The fsms before the cursor are updated, so that hooks falling asleep or freeing
+			// any fsm don't make the rest miss the tick, see StateMachinePool::Remove.
+			p.cursor = 0;
+			while (p.cursor < p.active.size())
+			{
+				auto h = p.active[p.cursor++];
+				p.lastUpdate[h] = p.tick;
+				SetHandlingFsm(p, h, ctx);
+				Update(ctx);
+			}
+			p.cursor = 0;
+			ClearHandlingFsm();
+		}
+
+		// Propagates ticking to active fsms in given pool, until the budget runs out.
+		// The next call resumes from where this one stops, in a round-robin way: a round visits
+		// the active fsms once, falling asleep doesn't reorder the rest of the round, and woken up
+		// fsms join its end. So while the active count holds, an fsm staying active is updated
+		// at least once every ceil(active / updated) calls.
+		// The stats scan the rest of the round, reading a handle and a tick for each fsm left.
+		UpdateStats Update(StateMachinePool<State>& p, const Context& ctx, const UpdateBudget& budget)
+		{
+			// The clock is checked once every such number of updates.
+			static const std::size_t ClockCheckInterval = 16;
+
+			p.Advance();
+			UpdateStats stats;
+			auto		start = std::chrono::steady_clock::now();
+			// Visits each fsm at most once.
+			auto n = p.active.size();
+
+			while (stats.updated < n)
+			{
+				if (budget.maxMachines > 0 && stats.updated >= budget.maxMachines)
+					break;
+				if (budget.maxTime.count() > 0 && stats.updated > 0
+					&& stats.updated % ClockCheckInterval == 0
+					&& std::chrono::steady_clock::now() - start >= budget.maxTime)
+					break;
+				if (p.cursor >= p.active.size())
+				{
+					if (p.active.empty())
+						break;
+					p.cursor = 0;
+				}
+				auto h = p.active[p.cursor++];
+				stats.maxStaleness = std::max(stats.maxStaleness, p.tick - p.lastUpdate[h]);
+				p.lastUpdate[h] = p.tick;
+				SetHandlingFsm(p, h, ctx);
+				Update(ctx);
+				++stats.updated;
+			}
+			ClearHandlingFsm();
+			// The fsms updated before wrapping around are left in the next round, but not skipped.
+			for (auto i = p.cursor; i < p.active.size(); ++i)
+				if (auto h = p.active[i]; p.lastUpdate[h] != p.tick)
+					++stats.skipped, stats.maxStaleness = std::max(stats.maxStaleness, p.tick - p.lastUpdate[h]);
+			return stats;
+		}
+
+		// Passes an event to current active state, or the active state of each region.
+		void Dispatch(const Context& ctx, const Event& event)
+		{
+			assert(m != nullptr);
+			if (tops != nullptr)
+			{
+				for (int r = 0; r < nRegions; ++r)
+					Focus(r), bt[m->stack[m->top]]->OnEvent(ctx, event);
+				return;
+			}
+			bt[m->stack[m->top]]->OnEvent(ctx, event);
+		}
+
+		// Passes a file descriptor's readiness to current active state.
+		void Ready(const Context& ctx, int fd, std::uint32_t events)
+		{
+			assert(m != nullptr);
+			bt[m->stack[m->top]]->OnReady(ctx, fd, events);
+		}
+
+		// Passes events in the inbox and queue of current handling fsm to current active state.
+		// Events in the inbox are passed through the queue if it's enabled.
+		void Drain(const Context& ctx)
+		{
+			if (pool->inboxes != nullptr)
+			{
+				auto& inbox = pool->inboxes[handle];
+				while (auto n = inbox.events.Pop())
+				{
+					// Delivers directly if not queued.
+					if (pool->queueCapacity == 0 || !pool->Enqueue(handle, std::move(n->event)))
+						bt[m->stack[m->top]]->OnEvent(ctx, n->event);
+					pool->events->Release(n);
+				}
+			}
+			if (pool->queueCapacity > 0)
+			{
+				std::size_t begin = handle * pool->priorities, end = begin + pool->priorities;
+				while (true)
+				{
+					// The most urgent non-empty ring, as OnEvent may queue more events.
+					auto q = begin;
+					while (q < end && pool->qsize[q] == 0)
+						++q;
+					if (q == end)
+						break;
+					auto e = pool->Dequeue(q);
+					bt[m->stack[m->top]]->OnEvent(ctx, e);
+				}
+			}
+		}
+
+		// Delivers signals to the fsm of handle h in given pool, which is currently in given state.
+		// The fsm is woken up if it's dormant.
+		// Stops once a hook returns true, or the fsm leaves the state.
+		template <typename Signals>
+		void Deliver(StateMachinePool<State>& p, Handle h, const Context& ctx, int state, const Signals& signals)
+		{
+			SetHandlingFsm(p, h, ctx);
+			p.Wake(h);
+			for (const auto& [id, data] : signals)
+				if (m->stack[m->top] != state || bt[state]->OnSignal(ctx, id, data))
+					break;
+		}
+
+		// Jump to a state asynchronously, the transition spans ticks, advanced by Update:
+		// the Exiting phase ticks OnExiting of current state until it completes, then it
+		// jumps, and the Entering phase ticks OnEntering of the target state until it completes.
+		// Neither state's Update runs meanwhile, and a synchronous transition cancels it unless
+		// it's rejected. If the jump throws, i.e. the target got locked, it's cancelled and Update rethrows.
+		void JumpAsync(const Context& ctx, const State& to)
+		{
+			assert(m != nullptr);
+			if (tops != nullptr)
+				throw std::runtime_error("pdfsm: asynchronous transition of a regional fsm");
+			assert(m->top >= 0);
+			CheckEntry(C(to)), Check(m->stack[m->top], C(to));
+			m->phase = Phase::Exiting, m->target = C(to), m->progress = 0;
+			if (pool != nullptr)
+				pool->Wake(handle);
+		}
+
+		// Jump to a state.
+		void Jump(const Context& ctx, const State& to)
+		{
+			assert(m != nullptr);
+			int x = C(to), scope = -1;
+			if (tops != nullptr && region[x] != focused)
+			{
+				Across(region[x], [&]() { Jump(ctx, to); });
+				return;
+			}
+			CheckEntry(x);
+			if (m->top != -1)
+				Check(m->stack[m->top], x);
+			// Cancels the asynchronous transition in progress, unless this one is rejected.
+			m->phase = Phase::None;
+			if (m->top != -1)
+			{
+				int from = m->stack[m->top];
+				if (hierarchy != nullptr)
+				{
+					scope = hierarchy->Scope(from, x);
+					--m->top;
+					Exit(ctx, from, scope);
+				}
+				else
+					bt[m->stack[m->top--]]->OnTerminate(ctx);
+			}
+			m->stack[++m->top] = x;
+			if (pool != nullptr)
+				pool->Wake(handle), pool->Move(handle, x);
+			if (hierarchy != nullptr)
+				Enter(ctx, x, scope);
+			else
+				bt[x]->OnEnter(ctx);
+			if (watched != nullptr)
+				watched->Publish(handle, x);
+		}
+
+		// Jump to a state, whose data is constructed from given entry data.
+		template <typename Data>
+		void Jump(const Context& ctx, const State& to, Data&& data)
+		{
+			SetEntry<Data>(to, data);
+			try
+			{
+				Jump(ctx, to);
+			}
+			catch (...)
+			{
+				entry = nullptr;
+				throw;
+			}
+			entry = nullptr;
+		}
+
+		// Pause current active state and push a new one, whose data is constructed from given entry data.
+		template <typename Data>
+		void Push(const Context& ctx, const State& to, Data&& data)
+		{
+			SetEntry<Data>(to, data);
+			try
+			{
+				Push(ctx, to);
+			}
+			catch (...)
+			{
+				entry = nullptr;
+				throw;
+			}
+			entry = nullptr;
+		}
+
+		// Pause current active state and push a new one.
+		void Push(const Context& ctx, const State& to)
+		{
+			assert(m != nullptr);
+			int x = C(to), scope = -1;
+			if (tops != nullptr && region[x] != focused)
+			{
+				Across(region[x], [&]() { Push(ctx, to); });
+				return;
+			}
+			CheckEntry(x);
+			if (m->top != -1)
+				Check(m->stack[m->top], x);
+			// Cancels the asynchronous transition in progress, unless this one is rejected.
+			m->phase = Phase::None;
+			if (m->top != -1)
+			{
+				if (hierarchy != nullptr)
+					scope = hierarchy->Scope(m->stack[m->top], x);
+				bt[m->stack[m->top]]->OnPause(ctx);
+			}
+			m->stack[++m->top] = x;
+			if (pool != nullptr)
+				pool->Wake(handle), pool->Move(handle, x);
+			if (hierarchy != nullptr)
+				Enter(ctx, x, scope);
+			else
+				bt[x]->OnEnter(ctx);
+			if (watched != nullptr)
+				watched->Publish(handle, x);
+		}
+
+		// Pop current active state and resume the previous paused state.
+		void Pop(const Context& ctx)
+		{
+			assert(m != nullptr);
+			assert(m->top >= 0);
+			m->phase = Phase::None;
+			if (hierarchy != nullptr)
+			{
+				// Terminates the path entered by the Push.
+				int from = m->stack[m->top--];
+				Exit(ctx, from, m->top >= 0 ? hierarchy->Scope(m->stack[m->top], from) : -1);
+			}
+			else
+				bt[m->stack[m->top--]]->OnTerminate(ctx);
+			if (pool != nullptr)
+				pool->Wake(handle), pool->Move(handle, m->stack[m->top]);
+			bt[m->stack[m->top]]->OnResume(ctx);
+			if (watched != nullptr)
+				watched->Publish(handle, m->stack[m->top]);
+		}
+
+		// Jumps along the shortest route to a state, each state on the route is entered and terminated
+		// in turn. Does nothing if it's already there. Throws a runtime_error before any transition
+		// if it's not reachable, or a state on the route is locked or needs entry data.
+		// The walk stops where a hook redirects the machine off the route.
+		void JumpPath(const Context& ctx, const State& to)
+		{
+			if (tops != nullptr && region[C(to)] != focused)
+			{
+				Across(region[C(to)], [&]() { JumpPath(ctx, to); });
+				return;
+			}
+			for (int x = CheckPath(C(to)); x != C(to);)
+			{
+				x = hops[x * N + C(to)];
+				Jump(ctx, static_cast<State>(x));
+				if (m->stack[m->top] != x)
+					return;
+			}
+		}
+
+		// Pushes along the shortest route to a state, so pops retrace the route.
+		// Does nothing if it's already there, and throws and stops like JumpPath.
+		void PushPath(const Context& ctx, const State& to)
+		{
+			if (tops != nullptr && region[C(to)] != focused)
+			{
+				Across(region[C(to)], [&]() { PushPath(ctx, to); });
+				return;
+			}
+			for (int x = CheckPath(C(to)); x != C(to);)
+			{
+				x = hops[x * N + C(to)];
+				Push(ctx, static_cast<State>(x));
+				if (m->stack[m->top] != x)
+					return;
+			}
+		}
+
+	private:
+		// Checks the route from current state to state to, returns current state.
+		int CheckPath(int to) const
+		{
+			assert(m != nullptr);
+			assert(m->top >= 0);
+			int from = m->stack[m->top];
+			Route();
+			if (dists[from * N + to] == Unreachable)
+				throw std::runtime_error("pdfsm: unreachable from " + std::to_string(from) + " to " + std::to_string(to));
+			for (int x = from; x != to;)
+			{
+				x = hops[x * N + to];
+				if (pool != nullptr && pool->Locked(handle, x))
+					throw std::runtime_error("pdfsm: locked path from " + std::to_string(from) + " to " + std::to_string(to));
+				CheckEntry(x);
+			}
+			return from;
+		}
+
+		// Data is the deduced type of a forwarding reference, rvalues are moved, lvalues are copied.
+		template <typename Data>
+		void SetEntry(const State& to, std::remove_reference_t<Data>& data)
+		{
+			static_assert(!std::is_lvalue_reference_v<Data> || std::is_copy_constructible_v<std::remove_cvref_t<Data>>,
+				"pdfsm: entry data passed as an lvalue should be copyable, or be moved");
+			if (!bt[C(to)]->AcceptsEntry(&TypeKey<std::remove_cvref_t<Data>>))
+				throw std::runtime_error("pdfsm: invalid entry data for state " + std::to_string(C(to)));
+			entry = const_cast<std::remove_cvref_t<Data>*>(&data), entryKey = &TypeKey<std::remove_cvref_t<Data>>;
+			entryState = C(to), entryMoved = !std::is_lvalue_reference_v<Data>;
+		}
+
+		// Makes given fsm the currently processing one.
+		void Bind(StateMachine<State>& x)
+		{
+			fsm = &x, tops = nullptr;
+			m = &ref.emplace(StackRef<State>{ x.stack, x.top, x.phase, x.target, x.progress });
+		}
+
+		// Makes region r the current region.
+		void Focus(int r)
+		{
+			focused = r;
+			m = &ref.emplace(StackRef<State>{ stacks + first[r], tops[r], noPhase, noTarget, noProgress });
+		}
+
+		// Calls fn with region r as the current region, then restores the current region.
+		template <typename Fn>
+		void Across(int r, Fn&& fn)
+		{
+			int prev = focused;
+			Focus(r);
+			try
+			{
+				fn();
+			}
+			catch (...)
+			{
+				Focus(prev);
+				throw;
+			}
+			Focus(prev);
+		}
+
+		// Ticks current active state, or advances the asynchronous transition in progress.
+		void Tick(const Context& ctx)
+		{
+			if (m->phase != Phase::None)
+			{
+				Transit(ctx);
+				return;
+			}
+			if (hierarchy != nullptr)
+			{
+				Bubble(ctx);
+				return;
+			}
+			if (bt[m->stack[m->top]]->BeforeUpdate(ctx))
+				return;
+			bt[m->stack[m->top]]->Update(ctx);
+		}
+
+		// Returns the frame at given level of the stack.
+		std::byte* Frame(int level) const
+		{
+			assert(frames != nullptr);
+			return frames + level * frameSize;
+		}
+
+		// Terminates state s and its ancestors below given scope, from the bottom up.
+		void Exit(const Context& ctx, int s, int scope)
+		{
+			for (int d = hierarchy->Depth(s); d > hierarchy->Depth(scope); --d)
+				bt[hierarchy->Ancestor(s, d)]->OnTerminate(ctx);
+		}
+
+		// Enters the ancestors of state s below given scope and s itself, from the top down.
+		void Enter(const Context& ctx, int s, int scope)
+		{
+			for (int d = hierarchy->Depth(scope) + 1; d <= hierarchy->Depth(s); ++d)
+				bt[hierarchy->Ancestor(s, d)]->OnEnter(ctx);
+		}
+
+		// Bubbles BeforeUpdate and then Update from the active state up to the root.
+		// Stops once a BeforeUpdate returns true, or a hook makes a transition.
+		void Bubble(const Context& ctx)
+		{
+			int s = m->stack[m->top], top = m->top, depth = hierarchy->Depth(s);
+			for (int d = depth; d >= 0; --d)
+				if (bt[hierarchy->Ancestor(s, d)]->BeforeUpdate(ctx) || m->top != top || m->stack[top] != s)
+					return;
+			for (int d = depth; d >= 0; --d)
+			{
+				bt[hierarchy->Ancestor(s, d)]->Update(ctx);
+				if (m->top != top || m->stack[top] != s)
+					return;
+			}
+		}
+
+		// Advances the asynchronous transition in progress by a tick.
+		void Transit(const Context& ctx)
+		{
+			if (m->phase == Phase::Exiting)
+			{
+				float progress = bt[m->stack[m->top]]->OnExiting(ctx);
+				// Cancelled or replaced by the hook.
+				if (m->phase != Phase::Exiting)
+					return;
+				m->progress = progress;
+				if (progress < 1.0f)
+					return;
+				int target = m->target;
+				try
+				{
+					Jump(ctx, static_cast<State>(target));
+				}
+				catch (...)
+				{
+					// i.e. the target got locked meanwhile, cancels it rather than failing every tick.
+					m->phase = Phase::None;
+					throw;
+				}
+				// A transition made by OnEnter of the target takes over.
+				if (m->phase != Phase::None || m->stack[m->top] != target)
+					return;
+				m->phase = Phase::Entering, m->progress = 0;
+			}
+			float progress = bt[m->stack[m->top]]->OnEntering(ctx);
+			if (m->phase != Phase::Entering)
+				return;
+			m->progress = progress;
+			if (progress >= 1.0f)
+				m->phase = Phase::None;
+		}
+
+		template <auto>
+		friend class ScriptBehavior;
+		template <auto, EnumClass>
+		friend class SubMachineBehavior;
+		template <auto, typename>
+		friend class DataBehavior;
+	};
+
+	//////////////////////
+	/// SubMachineBehavior
+	//////////////////////
+
+	// SubMachineBehavior is a state whose internal logic is a child machine of enum Child,
+	// handled by a child handler of the behaviors and transitions given on construction.
+	// The child machine lives inline in the parent NestedStateMachine, or in the child column
+	// of the parent's pool (see EnableChildren), so the parent handler only handles these,
+	// binding it to a flat machine, or a pool without the column, throws a runtime_error.
+	// Entering the state starts the child from its initial state, terminating it terminates
+	// the child's states from the top down, and hooks and updates are forwarded to the child.
+	// Derived classes overriding these hooks should call these ones.
+	template <auto EnumValue, EnumClass Child>
+	class SubMachineBehavior : public StateBehavior<EnumValue>
+	{
+	public:
+		SubMachineBehavior(const auto& behaviors, const auto& transitions)
+			: child(behaviors, transitions) {}
+
+		void OnSetup() override { this->GetHandler().childKeys.push_back(&TypeKey<Child>); }
+
+		// Returns the child handler, bound to the child machine inside the hooks.
+		StateMachineHandler<Child>& GetChildHandler(void) { return child; }
+
+		void OnEnter(const Context& ctx) override
+		{
+			ChildFsm().top = -1;
+			child.SetHandlingFsm(ChildFsm(), ctx);
+			child.ClearHandlingFsm();
+		}
+
+		void OnTerminate(const Context& ctx) override
+		{
+			auto& fsm = ChildFsm();
+			child.SetHandlingFsm(fsm, ctx);
+			while (fsm.top >= 0)
+				child.bt[fsm.stack[fsm.top--]]->OnTerminate(ctx);
+			child.ClearHandlingFsm();
+		}
+
+		void OnPause(const Context& ctx) override
+		{
+			child.SetHandlingFsm(ChildFsm(), ctx);
+			child.bt[child.m->stack[child.m->top]]->OnPause(ctx);
+			child.ClearHandlingFsm();
+		}
+
+		void OnResume(const Context& ctx) override
+		{
+			child.SetHandlingFsm(ChildFsm(), ctx);
+			child.bt[child.m->stack[child.m->top]]->OnResume(ctx);
+			child.ClearHandlingFsm();
+		}
+
+		void Update(const Context& ctx) override
+		{
+			child.SetHandlingFsm(ChildFsm(), ctx);
+			child.Update(ctx);
+			child.ClearHandlingFsm();
+		}
+
+		void OnEvent(const Context& ctx, const Event& event) override
+		{
+			child.SetHandlingFsm(ChildFsm(), ctx);
+			child.Dispatch(ctx, event);
+			child.ClearHandlingFsm();
+		}
+
+	private:
+		StateMachineHandler<Child> child;
+
+		StateMachine<Child>& ChildFsm(void)
+		{
+			auto& h = this->GetHandler();
+			if (h.pool != nullptr)
+				return h.pool->template Child<Child>(h.handle);
+			assert(h.locate != nullptr);
+			auto fsm = static_cast<StateMachine<Child>*>(h.locate(h.fsm, &TypeKey<Child>));
+			assert(fsm != nullptr);
+			return *fsm;
+		}
+	};
+
+	//////////////////////
+	/// DataBehavior
+	//////////////////////
+
+	// DataBehavior is a state with typed local data, stored inline in the stack frame of the
+	// machine (see DataStateMachine). The data is constructed on entering the state, from the
+	// entry data given to Jump or Push, or by default, and it's destroyed on termination.
+	// Hooks get the data directly. Hierarchies, pools and regional machines are not supported,
+	// setting a hierarchy, or binding the handler to a machine without frames large enough
+	// throws a runtime_error. Entering without entry data throws before the transition, if
+	// the data isn't default constructible.
+	// Derived classes overriding OnSetup should call this one.
+	template <auto EnumValue, typename Data>
+	class DataBehavior : public StateBehavior<EnumValue>
+	{
+		static_assert(alignof(Data) <= alignof(std::max_align_t));
+
+	public:
+		void OnSetup() override
+		{
+			auto& h = this->GetHandler();
+			h.dataSize = std::max(h.dataSize, sizeof(Data));
+		}
+
+		virtual void OnEnter(const Context& ctx, Data& data) {}
+		virtual void OnTerminate(const Context& ctx, Data& data) {}
+		virtual void OnPause(const Context& ctx, Data& data) {}
+		virtual void OnResume(const Context& ctx, Data& data) {}
+		virtual bool BeforeUpdate(const Context& ctx, Data& data) { return false; }
+		virtual void Update(const Context& ctx, Data& data) {}
+		virtual void OnEvent(const Context& ctx, const Event& event, Data& data) {}
+
+		void OnEnter(const Context& ctx) final
+		{
+			auto& h = this->GetHandler();
+			if (h.frames == nullptr || sizeof(Data) > h.frameSize)
+				throw std::runtime_error("pdfsm: no frame for the data of state " + std::to_string(static_cast<int>(EnumValue)));
+			auto p = h.Frame(h.m->top);
+			if (h.entry != nullptr && h.entryState == static_cast<int>(EnumValue))
+			{
+				assert(h.entryKey == &TypeKey<Data>);
+				auto entry = static_cast<Data*>(h.entry);
+				h.entry = nullptr;
+				// Lvalues of non-copyable data are rejected at compile time, see SetEntry.
+				if constexpr (std::is_copy_constructible_v<Data>)
+					h.entryMoved ? new (p) Data(std::move(*entry)) : new (p) Data(*entry);
+				else
+					assert(h.entryMoved), new (p) Data(std::move(*entry));
+			}
+			else
+			{
+				// Entering without data is rejected before the transition otherwise, see CheckEntry.
+				if constexpr (std::is_default_constructible_v<Data>)
+					new (p) Data();
+				else
+					assert(false);
+			}
+			OnEnter(ctx, At(h.m->top));
+		}
+
+		// The stack is popped before OnTerminate, so the frame is the one above the top.
+		void OnTerminate(const Context& ctx) final
+		{
+			auto& data = At(this->GetHandler().m->top + 1);
+			OnTerminate(ctx, data);
+			data.~Data();
+		}
+
+		void OnPause(const Context& ctx) final { OnPause(ctx, Top()); }
+		void OnResume(const Context& ctx) final { OnResume(ctx, Top()); }
+		bool BeforeUpdate(const Context& ctx) final { return BeforeUpdate(ctx, Top()); }
+		void Update(const Context& ctx) final { Update(ctx, Top()); }
+		void OnEvent(const Context& ctx, const Event& event) final { OnEvent(ctx, event, Top()); }
+		bool AcceptsEntry(const void* key) const final
+		{
+			return key == &TypeKey<Data> || (key == nullptr && std::is_default_constructible_v<Data>);
+		}
+
+	private:
+		Data& At(int level) { return *std::launder(reinterpret_cast<Data*>(this->GetHandler().Frame(level))); }
+		Data& Top(void) { return At(this->GetHandler().m->top); }
+	};
+
+	//////////////////////
+	/// ScriptBehavior
+	//////////////////////
+
+	// ScriptBehavior is a state authored as a coroutine. Run starts on OnEnter, and it may
+	// co_await NextTick, Delay or NextEvent, each tick costs at most a single resume.
+	// The frame lives in the machine's slot for this state, allocated from the pool's frame
+	// pool (see EnableScripts), and it's destroyed on OnTerminate.
+	// Requires the machine handled within a pool, and the state appears at most once on its stack.
+	// Machines run by an ActorRuntime aren't ticked, so their scripts are resumed only by NextEvent,
+	// and a script may be resumed by another worker's handler than the one starting it, so Run
+	// should reach the machine only by GetHandler().
+	// Derived classes overriding OnEnter, OnTerminate, Update or OnEvent should call these ones.
+	// Notes that the ctx argument of Run is only valid until the first co_await, and the code
+	// after a transition out of this state still runs until the next co_await (or co_return).
+	template <auto EnumValue>
+	class ScriptBehavior : public StateBehavior<EnumValue>
+	{
+		using Base = IStateBehaviorBase<decltype(EnumValue)>;
+
+	public:
+		using State = decltype(EnumValue);
+		using Awaiting = ScriptPromise::Awaiting;
+
+		virtual Script Run(const Context& ctx) = 0;
+
+		void OnEnter(const Context& ctx) override
+		{
+			auto& co = Frame();
+			assert(!co);
+			co = Run(ctx).co;
+			Resume(co, ctx);
+		}
+
+		void OnTerminate(const Context& ctx) override
+		{
+			auto& co = Frame();
+			if (!co)
+				return;
+			// Destroyed after the running resumption returns.
+			if (co.promise().running)
+				co.promise().terminated = true;
+			else
+				co.destroy();
+			co = nullptr;
+		}
+
+		void Update(const Context& ctx) override
+		{
+			auto co = Frame();
+			if (!co || co.done())
+				return;
+			auto& p = co.promise();
+			if (p.awaiting == Awaiting::Delay)
+			{
+				p.remaining -= ctx.delta;
+				if (p.remaining.count() > 0)
+					return;
+			}
+			else if (p.awaiting != Awaiting::Tick)
+				return;
+			Resume(co, ctx);
+		}
+
+		void OnEvent(const Context& ctx, const Event& event) override
+		{
+			auto co = Frame();
+			if (!co || co.done())
+				return;
+			auto& p = co.promise();
+			if (p.awaiting != Awaiting::Event || (!p.matchAny && p.eventId != event.id))
+				return;
+			p.event = &event;
+			Resume(co, ctx);
+		}
+
+		// Returns the frame pool of current handling pool, for allocating frames.
+		FramePool& ScriptFrames(void)
+		{
+			auto pool = Base::GetHandler().pool;
+			assert(pool != nullptr && pool->frames != nullptr);
+			return *pool->frames;
+		}
+
+	protected:
+		// Returns the handler resuming the script, inside Run.
+		StateMachineHandler<State>& GetHandler() { return resuming != nullptr ? *resuming : Base::GetHandler(); }
+
+	private:
+		// Handler resuming a script on this thread, if any.
+		static inline thread_local StateMachineHandler<State>* resuming = nullptr;
+
+		std::coroutine_handle<ScriptPromise>& Frame(void)
+		{
+			auto& h = Base::GetHandler();
+			assert(h.pool != nullptr && h.pool->frames != nullptr);
+			return h.pool->scripts[h.handle * static_cast<int>(State::N) + static_cast<int>(EnumValue)];
+		}
+
+		void Resume(std::coroutine_handle<ScriptPromise> co, const Context& ctx)
+		{
+			auto& p = co.promise();
+			auto  prev = resuming;
+			p.ctx = &ctx, p.awaiting = Awaiting::None, p.running = true;
+			resuming = &Base::GetHandler();
+			try
+			{
+				co.resume();
+			}
+			catch (...)
+			{
+				resuming = prev, p.running = false;
+				if (p.terminated)
+					co.destroy();
+				throw;
+			}
+			resuming = prev, p.running = false;
+			if (p.terminated)
+				co.destroy();
+		}
+	};
+
+	//////////////////////
+	/// SignalRouter
+	//////////////////////
+
+	// SignalRouter delivers fired signals only to the machines whose current state subscribes.
+	// Where M is the size of the signal signature, e.g. the N of a Blinker::Board<N>.
+	// Each state declares a subscription signature, and on routing, the fired signature is
+	// intersected with the subscriptions once, and only the members of matched states
+	// (by the pool's membership index) are visited, instead of polling every machine.
+	template <EnumClass State, std::size_t M>
+	class SignalRouter
+	{
+	public:
+		using Signature = std::bitset<M>;
+
+		// Subscribes signals for given state, merged with the existing subscription.
+		void Subscribe(State state, const Signature& signature)
+		{
+			int s = static_cast<int>(state);
+			if (sigs[s].none() && signature.any())
+				subscribed.push_back(s);
+			sigs[s] |= signature;
+		}
+
+		const Signature& Subscription(State state) const { return sigs[static_cast<int>(state)]; }
+
+		// Routes fired signals to the machines in given pool, calling their OnSignal hooks.
+		// poll(signature, cb) should call cb(signalId, data) for each fired signal
+		// matching the signature, e.g. Blinker::Board<M>::Poll.
+		// Returns the number of deliveries made to machines.
+		template <typename Poll>
+		int Route(StateMachineHandler<State>& h, StateMachinePool<State>& pool, const Context& ctx,
+			const Signature& fired, Poll&& poll)
+		{
+			if (fired.none())
+				return 0;
+			// Snapshots the targets of all subscribed states before delivering, since a machine
+			// transiting to another subscribed state shouldn't receive the signals twice.
+			signals.clear();
+			targets.clear();
+			batches.clear();
+			for (auto s : subscribed)
+			{
+				const auto& members = pool.Members(static_cast<State>(s));
+				if (members.empty())
+					continue;
+				auto match = sigs[s] & fired;
+				if (match.none())
+					continue;
+				Batch b{ s, targets.size(), 0, signals.size(), 0 };
+				poll(match, [this](std::size_t id, std::any data) { signals.emplace_back(id, std::move(data)); });
+				targets.insert(targets.end(), members.begin(), members.end());
+				b.targetsEnd = targets.size(), b.signalsEnd = signals.size();
+				batches.push_back(b);
+			}
+			for (const auto& b : batches)
+			{
+				std::span<const std::pair<std::size_t, std::any>> sg(signals.data() + b.signalsBegin, b.signalsEnd - b.signalsBegin);
+				for (auto i = b.targetsBegin; i < b.targetsEnd; ++i)
+					h.Deliver(pool, targets[i], ctx, b.state, sg);
+			}
+			h.ClearHandlingFsm();
+			return static_cast<int>(targets.size());
+		}
+
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+		// sigs[s] is the subscription of state s.
+		Signature sigs[N];
+		// States with a non-empty subscription.
+		std::vector<int> subscribed;
+		// Targets and signals of a subscribed state, ranges into the reused buffers.
+		struct Batch
+		{
+			int			state;
+			std::size_t targetsBegin, targetsEnd, signalsBegin, signalsEnd;
+		};
+		// Reused buffers.
+		std::vector<std::pair<std::size_t, std::any>> signals;
+		std::vector<Handle>							  targets;
+		std::vector<Batch>							  batches;
+	};
+
+	//////////////////////
+	/// GuardProgram
+	//////////////////////
+
+	// GuardProgram fires the guarded transitions of a transition table, whose guards hold on
+	// the fields of the machines in a pool (see StateMachinePool::EnableFields).
+	// A guard is an expression over the declared fields and numbers, by operators
+	// || && ! < <= > >= == != + - * / and parentheses, where zero is false.
+	// Guards are compiled on construction into a flat stack bytecode, and they're evaluated in
+	// batches of consecutive handles, each instruction is a loop over a batch of lanes, loading
+	// contiguous ranges of the field columns. Batches having no machine in a state skip its guards.
+	// A guarded transition has a single target, the first holding guard of a state fires.
+	// Guards are batch-only: a guarded transition is valid by the table, and a behavior may
+	// Jump along it whether the guard holds or not.
+	template <EnumClass State>
+	class GuardProgram
+	{
+	public:
+		// Batch size.
+		static const int Lanes = 64;
+
+		// Compiles the guards of given transitions over given fields, in the order of the
+		// pool's field columns, throws a runtime_error on an invalid guard.
+		GuardProgram(const TransitionTable<State>& transitions, std::initializer_list<const char*> fields)
+			: names(fields.begin(), fields.end())
+		{
+			for (const auto& t : transitions)
+			{
+				if (t.guard == nullptr)
+					continue;
+				if (t.targets.size() != 1)
+					throw std::runtime_error("pdfsm: guarded transition should have a single target");
+				Guard g{ static_cast<int>(t.from), static_cast<int>(*t.targets.begin()), static_cast<int>(ops.size()), 0 };
+				src = t.guard, at = 0, depth = 0;
+				Or();
+				Skip();
+				if (at < src.size())
+					Fail();
+				g.end = static_cast<int>(ops.size());
+				if (guarded[g.from].empty())
+					states.push_back(g.from);
+				guarded[g.from].push_back(g);
+			}
+			stack.resize(maxDepth * Lanes);
+		}
+
+		// Returns the index of given field, -1 if not declared.
+		int Field(std::string_view name) const
+		{
+			for (std::size_t i = 0; i < names.size(); ++i)
+				if (names[i] == name)
+					return static_cast<int>(i);
+			return -1;
+		}
+
+		// Fires the guarded transitions holding for the machines in given pool, by given handler.
+		// Dormant machines and locked targets are skipped.
+		// Returns the number of transitions fired, throws a runtime_error if the pool has fewer
+		// fields than declared.
+		int Fire(StateMachineHandler<State>& h, StateMachinePool<State>& pool, const Context& ctx)
+		{
+			if (pool.NumFields() < names.size())
+				throw std::runtime_error("pdfsm: pool has " + std::to_string(pool.NumFields()) + " fields, guards need " + std::to_string(names.size()));
+			fired.clear();
+			live.clear();
+			for (auto s : states)
+				if (!pool.members[s].empty())
+					live.push_back(s);
+			const int* cur = pool.cur.data();
+			for (std::size_t i = 0, total = pool.cur.size(); i < total && !live.empty(); i += Lanes)
+			{
+				int n = static_cast<int>(std::min<std::size_t>(Lanes, total - i));
+				int to[Lanes];
+				std::fill(to, to + n, -1);
+				for (auto s : live)
+				{
+					if (std::none_of(cur + i, cur + i + n, [s](int x) { return x == s; }))
+						continue;
+					for (const auto& g : guarded[s])
+					{
+						const float* r = Eval(g, pool, i, n);
+						for (int k = 0; k < n; ++k)
+							to[k] = ((to[k] < 0) & (cur[i + k] == s) & (r[k] != 0)) ? g.to : to[k];
+					}
+				}
+				for (int k = 0; k < n; ++k)
+					if (Handle x = static_cast<Handle>(i + k); to[k] >= 0 && !pool.IsDormant(x) && !pool.IsLocked(x, static_cast<State>(to[k])))
+						fired.emplace_back(x, to[k]);
+			}
+			// Members change on transitions.
+			for (auto [x, to] : fired)
+			{
+				h.SetHandlingFsm(pool, x, ctx);
+				h.Jump(ctx, static_cast<State>(to));
+			}
+			h.ClearHandlingFsm();
+			return static_cast<int>(fired.size());
+		}
+
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+
+		enum class Code : unsigned char
+		{
+			Load,
+			Const,
+			Not,
+			Neg,
+			Add,
+			Sub,
+			Mul,
+			Div,
+			Lt,
+			Le,
+			Gt,
+			Ge,
+			Eq,
+			Ne,
+			And,
+			Or,
+		};
+
+		struct Op
+		{
+			Code  code;
+			int	  field = 0;
+			float value = 0;
+		};
+
+		// Guard of a transition, ops[begin, end) is its program.
+		struct Guard
+		{
+			int from, to, begin, end;
+		};
+
+		std::vector<std::string> names;
+		std::vector<Op>			 ops;
+		// guarded[s] are the guards from state s, in the order of the table.
+		std::vector<Guard> guarded[N];
+		// States having guards, and the ones having members, reused.
+		std::vector<int> states, live;
+		// Evaluation stack of lanes, and the fired transitions, reused.
+		std::vector<float>					stack;
+		std::vector<std::pair<Handle, int>>	fired;
+		int									maxDepth = 0;
+
+		// Evaluates a guard on the batch of n machines from handle i, returns the results.
+		const float* Eval(const Guard& g, StateMachinePool<State>& pool, std::size_t i, int n)
+		{
+			int top = -1;
+			for (int j = g.begin; j < g.end; ++j)
+			{
+				const auto& op = ops[j];
+				if (op.code == Code::Load || op.code == Code::Const)
+					++top;
+				float* b = stack.data() + top * Lanes;
+				float* a = op.code <= Code::Neg ? b : b - Lanes;
+				// Applies f lane by lane, a loop the compiler vectorizes.
+				auto each = [&](auto f) {
+					for (int k = 0; k < n; ++k)
+						a[k] = f(a[k], b[k]);
+				};
+				switch (op.code)
+				{
+					case Code::Load:
+					{
+						const float* column = pool.Field(op.field) + i;
+						std::copy(column, column + n, a);
+						break;
+					}
+					case Code::Const:
+						std::fill(a, a + n, op.value);
+						break;
+					case Code::Not:
+						each([](float x, float) { return float(x == 0); });
+						break;
+					case Code::Neg:
+						each([](float x, float) { return -x; });
+						break;
+					case Code::Add:
+						each([](float x, float y) { return x + y; });
+						break;
+					case Code::Sub:
+						each([](float x, float y) { return x - y; });
+						break;
+					case Code::Mul:
+						each([](float x, float y) { return x * y; });
+						break;
+					case Code::Div:
+						each([](float x, float y) { return x / y; });
+						break;
+					case Code::Lt:
+						each([](float x, float y) { return float(x < y); });
+						break;
+					case Code::Le:
+						each([](float x, float y) { return float(x <= y); });
+						break;
+					case Code::Gt:
+						each([](float x, float y) { return float(x > y); });
+						break;
+					case Code::Ge:
+						each([](float x, float y) { return float(x >= y); });
+						break;
+					case Code::Eq:
+						each([](float x, float y) { return float(x == y); });
+						break;
+					case Code::Ne:
+						each([](float x, float y) { return float(x != y); });
+						break;
+					case Code::And:
+						each([](float x, float y) { return float((x != 0) & (y != 0)); });
+						break;
+					case Code::Or:
+						each([](float x, float y) { return float((x != 0) | (y != 0)); });
+						break;
+				}
+				if (op.code > Code::Neg)
+					--top;
+			}
+			return stack.data();
+		}
+
+		// Compiler state, a recursive descent parser emitting postfix ops.
+		std::string_view src;
+		std::size_t		 at = 0;
+		int				 depth = 0;
+
+		[[noreturn]] void Fail(void) const
+		{
+			throw std::runtime_error("pdfsm: invalid guard \"" + std::string(src) + "\" at " + std::to_string(at));
+		}
+		void Skip(void)
+		{
+			while (at < src.size() && src[at] == ' ')
+				++at;
+		}
+		// Consumes given token if it's next.
+		bool Accept(std::string_view token)
+		{
+			Skip();
+			if (src.substr(at, token.size()) != token)
+				return false;
+			// Not a prefix of a longer operator, i.e. < of <=.
+			if (token.size() == 1 && at + 1 < src.size() && src[at + 1] == '=' && token != "(" && token != ")")
+				return false;
+			at += token.size();
+			return true;
+		}
+		void Emit(Code code, int field = 0, float value = 0)
+		{
+			ops.push_back({ code, field, value });
+			if (code == Code::Load || code == Code::Const)
+				maxDepth = std::max(maxDepth, ++depth);
+			else if (code > Code::Neg)
+				--depth;
+		}
+		void Or(void)
+		{
+			And();
+			while (Accept("||"))
+				And(), Emit(Code::Or);
+		}
+		void And(void)
+		{
+			Compare();
+			while (Accept("&&"))
+				Compare(), Emit(Code::And);
+		}
+		void Compare(void)
+		{
+			Sum();
+			static constexpr std::pair<std::string_view, Code> comparisons[] = {
+				{ "<=", Code::Le }, { ">=", Code::Ge }, { "==", Code::Eq }, { "!=", Code::Ne }, { "<", Code::Lt }, { ">", Code::Gt }
+			};
+			for (auto [token, code] : comparisons)
+				if (Accept(token))
+					return Sum(), Emit(code);
+		}
+		void Sum(void)
+		{
+			Product();
+			for (;;)
+				if (Accept("+"))
+					Product(), Emit(Code::Add);
+				else if (Accept("-"))
+					Product(), Emit(Code::Sub);
+				else
+					return;
+		}
+		void Product(void)
+		{
+			Unary();
+			for (;;)
+				if (Accept("*"))
+					Unary(), Emit(Code::Mul);
+				else if (Accept("/"))
+					Unary(), Emit(Code::Div);
+				else
+					return;
+		}
+		void Unary(void)
+		{
+			if (Accept("!"))
+				return Unary(), Emit(Code::Not);
+			if (Accept("-"))
+				return Unary(), Emit(Code::Neg);
+			Primary();
+		}
+		void Primary(void)
+		{
+			Skip();
+			if (Accept("("))
+			{
+				Or();
+				if (!Accept(")"))
+					Fail();
+				return;
+			}
+			auto begin = at;
+			auto isName = [](char c) { return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'); };
+			if (at < src.size() && ((src[at] >= '0' && src[at] <= '9') || src[at] == '.'))
+			{
+				std::string number(src.substr(at));
+				char*		end = nullptr;
+				float		value = std::strtof(number.c_str(), &end);
+				at += end - number.c_str();
+				if (at == begin)
+					Fail();
+				return Emit(Code::Const, 0, value);
+			}
+			while (at < src.size() && isName(src[at]))
+				++at;
+			int field = Field(src.substr(begin, at - begin));
+			if (at == begin || field < 0)
+				at = begin, Fail();
+			Emit(Code::Load, field);
+		}
+	};
+
+	//////////////////////
+	/// RuleEngine
+	//////////////////////
+
+	enum class Comparator : unsigned char
+	{
+		Lt,
+		Le,
+		Gt,
+		Ge,
+		Eq,
+		Ne,
+	};
+
+	// ThresholdRule is a transition from a state to another once a field compares to a constant,
+	// i.e. { Fight, health, Comparator::Lt, 20, Flee }.
+	template <EnumClass State>
+	struct ThresholdRule
+	{
+		State	   from;
+		int		   field;
+		Comparator comparator;
+		float	   value;
+		State	   to;
+	};
+
+	// RuleEngine evaluates threshold rules over the field columns of a pool
+	// (see StateMachinePool::EnableFields), instead of behaviors comparing numbers on updates.
+	// Each rule is a single pass over the contiguous columns of the field and current states,
+	// the first matching rule of a machine wins, in the order of declaration.
+	template <EnumClass State>
+	class RuleEngine
+	{
+	public:
+		// Throws a runtime_error if a rule is an invalid transition by given handler, or its field is negative.
+		RuleEngine(const StateMachineHandler<State>& h, std::initializer_list<ThresholdRule<State>> rules)
+			: rules(rules)
+		{
+			for (const auto& r : rules)
+			{
+				if (!h.IsValid(r.from, r.to))
+					throw std::runtime_error("pdfsm: invalid rule from " + std::to_string(static_cast<int>(r.from)) + " to " + std::to_string(static_cast<int>(r.to)));
+				if (r.field < 0)
+					throw std::runtime_error("pdfsm: invalid rule field " + std::to_string(r.field));
+				nFields = std::max(nFields, static_cast<std::size_t>(r.field) + 1);
+			}
+		}
+
+		// Evaluates the rules over the machines of given pool, returns the transitions to make,
+		// as (machine, target). Dormant machines and locked targets are skipped.
+		// Throws a runtime_error if the pool has fewer fields than the rules read.
+		const std::vector<std::pair<Handle, State>>& Evaluate(const StateMachinePool<State>& pool)
+		{
+			if (pool.fields.size() < nFields)
+				throw std::runtime_error("pdfsm: pool has " + std::to_string(pool.fields.size()) + " fields, rules need " + std::to_string(nFields));
+			auto n = pool.machines.size();
+			to.assign(n, -1);
+			for (const auto& r : rules)
+			{
+				if (pool.members[static_cast<int>(r.from)].empty())
+					continue;
+				const float* column = pool.fields[r.field].data();
+				switch (r.comparator)
+				{
+					case Comparator::Lt:
+						Apply(pool, r, column, [](float x, float c) { return x < c; });
+						break;
+					case Comparator::Le:
+						Apply(pool, r, column, [](float x, float c) { return x <= c; });
+						break;
+					case Comparator::Gt:
+						Apply(pool, r, column, [](float x, float c) { return x > c; });
+						break;
+					case Comparator::Ge:
+						Apply(pool, r, column, [](float x, float c) { return x >= c; });
+						break;
+					case Comparator::Eq:
+						Apply(pool, r, column, [](float x, float c) { return x == c; });
+						break;
+					case Comparator::Ne:
+						Apply(pool, r, column, [](float x, float c) { return x != c; });
+						break;
+				}
+			}
+			batch.clear();
+			for (Handle h = 0; h < n; ++h)
+				if (to[h] >= 0 && pool.pos[h] >= 0 && !pool.Locked(h, to[h]))
+					batch.emplace_back(h, static_cast<State>(to[h]));
+			return batch;
+		}
+
+		// Evaluates the rules, and makes the transitions by given handler.
+		// Returns the number of transitions made.
+		int Fire(StateMachineHandler<State>& h, StateMachinePool<State>& pool, const Context& ctx)
+		{
+			for (auto [x, s] : Evaluate(pool))
+			{
+				h.SetHandlingFsm(pool, x, ctx);
+				h.Jump(ctx, s);
+			}
+			h.ClearHandlingFsm();
+			return static_cast<int>(batch.size());
+		}
+
+	private:
+		std::vector<ThresholdRule<State>> rules;
+		// Number of fields the rules read.
+		std::size_t nFields = 0;
+		// to[h] is the target of machine h, -1 for none, and the transitions, reused.
+		std::vector<int>					  to;
+		std::vector<std::pair<Handle, State>> batch;
+
+		// Marks the machines in the rule's from state, whose field matches, a branchless loop
+		// the compiler vectorizes.
+		template <typename F>
+		void Apply(const StateMachinePool<State>& pool, const ThresholdRule<State>& r, const float* column, F f)
+		{
+			const int* cur = pool.cur.data();
+			int*	   t = to.data();
+			int		   from = static_cast<int>(r.from), target = static_cast<int>(r.to);
+			float	   value = r.value;
+			for (std::size_t h = 0, n = to.size(); h < n; ++h)
+				t[h] = ((t[h] < 0) & (cur[h] == from) & f(column[h], value)) ? target : t[h];
+		}
+	};
+
+	//////////////////////
+	/// UtilitySelector
+	//////////////////////
+
+	// UtilitySelector chooses the next states of machines in a pool by utility: each target
+	// state registers a scoring kernel, the legal targets of a state are scored for all its
+	// members in a batch, and each machine transits to its best target.
+	// A target is chosen only if its score is above the threshold, so low scores mean staying.
+	template <EnumClass State>
+	class UtilitySelector
+	{
+	public:
+		// Kernel(hs, n, scores) writes scores[i], the utility of machine hs[i] entering the state.
+		// A kernel reading pool columns (see StateMachinePool::EnableFields) vectorizes well.
+		using Kernel = std::function<void(const Handle* hs, std::size_t n, float* scores)>;
+
+		explicit UtilitySelector(float threshold = 0) : threshold(threshold) {}
+
+		// Registers the scoring kernel of given target state.
+		void Score(State to, Kernel kernel)
+		{
+			int s = static_cast<int>(to);
+			if (!kernels[s])
+				scored.push_back(s);
+			kernels[s] = std::move(kernel);
+		}
+
+		// Registers a scoring function of given target state, called for each machine.
+		void ScoreEach(State to, std::function<float(Handle)> f)
+		{
+			Score(to, [f = std::move(f)](const Handle* hs, std::size_t n, float* scores) {
+				for (std::size_t i = 0; i < n; ++i)
+					scores[i] = f(hs[i]);
+			});
+		}
+
+		// Chooses for the (not dormant) machines in given state of a pool, and transits them by given handler.
+		// Locked targets are not chosen. Returns the number of transitions made.
+		int Choose(StateMachineHandler<State>& h, StateMachinePool<State>& pool, State from, const Context& ctx)
+		{
+			decisions.clear();
+			Decide(h, pool, from);
+			return Apply(h, pool, ctx);
+		}
+
+		// Chooses for the machines in all states of a pool, decided before any transition,
+		// so a machine transits at most once.
+		int Choose(StateMachineHandler<State>& h, StateMachinePool<State>& pool, const Context& ctx)
+		{
+			decisions.clear();
+			for (int s = 0; s < N; ++s)
+				Decide(h, pool, static_cast<State>(s));
+			return Apply(h, pool, ctx);
+		}
+
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+
+		float threshold;
+		// kernels[s] scores target s, if any, and the states scored.
+		Kernel			 kernels[N];
+		std::vector<int> scored;
+		// Reused buffers, decisions are (machine, target).
+		std::vector<Handle>					group;
+		std::vector<float>					best, scores;
+		std::vector<int>					choice;
+		std::vector<std::pair<Handle, int>> decisions;
+
+		// Scores the legal targets for the members of given state, and decides their best targets.
+		void Decide(const StateMachineHandler<State>& h, StateMachinePool<State>& pool, State from)
+		{
+			group.clear();
+			for (auto x : pool.Members(from))
+				if (!pool.IsDormant(x))
+					group.push_back(x);
+			auto n = group.size();
+			if (n == 0)
+				return;
+			best.assign(n, threshold);
+			choice.assign(n, -1);
+			scores.resize(n);
+			auto targets = h.Targets(from);
+			for (auto to : scored)
+			{
+				if (!targets[to])
+					continue;
+				kernels[to](group.data(), n, scores.data());
+				if (pool.HasLocks())
+					for (std::size_t i = 0; i < n; ++i)
+						if (pool.IsLocked(group[i], static_cast<State>(to)))
+							scores[i] = -std::numeric_limits<float>::infinity();
+				// Argmax, a branchless loop.
+				float* b = best.data();
+				int*   c = choice.data();
+				for (std::size_t i = 0; i < n; ++i)
+				{
+					bool better = scores[i] > b[i];
+					b[i] = better ? scores[i] : b[i];
+					c[i] = better ? to : c[i];
+				}
+			}
+			for (std::size_t i = 0; i < n; ++i)
+				if (choice[i] >= 0)
+					decisions.emplace_back(group[i], choice[i]);
+		}
+
+		int Apply(StateMachineHandler<State>& h, StateMachinePool<State>& pool, const Context& ctx)
+		{
+			for (auto [x, to] : decisions)
+			{
+				h.SetHandlingFsm(pool, x, ctx);
+				h.Jump(ctx, static_cast<State>(to));
+			}
+			h.ClearHandlingFsm();
+			return static_cast<int>(decisions.size());
+		}
+	};
+
+	//////////////////////
+	/// MarkovChain
+	//////////////////////
+
+	// CounterRng is a counter-based random number generator, the n-th number is a pure
+	// function of the seed and n (by the SplitMix64 finalizer), so any number is O(1) to get,
+	// and a stream is deterministic however it's split.
+	struct CounterRng
+	{
+		std::uint64_t seed = 0;
+		// Number of steps taken, advanced by MarkovChain::Step.
+		std::uint64_t step = 0;
+
+		std::uint64_t operator()(std::uint64_t n) const
+		{
+			std::uint64_t z = seed + (n + 1) * 0x9E3779B97F4A7C15ull;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			return z ^ (z >> 31);
+		}
+	};
+
+	// MarkovChain moves machines of a pool to random next states, by the weights of the
+	// transitions in a table, i.e. population simulations. The weights of each state are compiled
+	// into a Walker alias table, sampling a next state is O(1) by a single random number.
+	// States without weights are absorbing. A step sets the states directly, without hooks of
+	// behaviors, and keeps the pool's membership index.
+	template <EnumClass State>
+	class MarkovChain
+	{
+	public:
+		// Throws a runtime_error if the weights of a transition don't match its targets, or
+		// the weights of a state are negative or all zero.
+		explicit MarkovChain(const TransitionTable<State>& transitions)
+		{
+			std::vector<std::pair<int, float>> edges[N];
+			for (const auto& t : transitions)
+			{
+				if (t.weights.size() == 0)
+					continue;
+				if (t.weights.size() != t.targets.size())
+					throw std::runtime_error("pdfsm: weights should match targets");
+				auto w = t.weights.begin();
+				for (const auto& to : t.targets)
+					edges[static_cast<int>(t.from)].emplace_back(static_cast<int>(to), *w++);
+			}
+			for (int s = 0; s < N; ++s)
+				Build(s, edges[s]);
+		}
+
+		// Samples the next state from given state, by a random number.
+		State Sample(State from, std::uint64_t r) const { return static_cast<State>(Next(static_cast<int>(from), r)); }
+
+		// Advances the active machines of given pool by a step, each by the number of the rng
+		// keyed by the step and its handle, so results are deterministic per seed, and
+		// independent of the order. Locked targets are not taken.
+		// Returns the number of machines changed their states.
+		int Step(StateMachinePool<State>& pool, CounterRng& rng)
+		{
+			auto	   n = pool.cur.size();
+			const int* cur = pool.cur.data();
+			const int* pos = pool.pos.data();
+			next.resize(n);
+			// Sampling is a pure function of the handle, free of dependencies between machines.
+			std::uint64_t key = rng.step++ << 32;
+			for (std::size_t h = 0; h < n; ++h)
+				next[h] = cur[h] >= 0 && pos[h] >= 0 ? Next(cur[h], rng(key | h)) : cur[h];
+			int changed = 0;
+			for (Handle h = 0; h < n; ++h)
+			{
+				if (next[h] == cur[h])
+					continue;
+				if (pool.Locked(h, next[h]))
+					continue;
+				auto& fsm = pool.machines[h];
+				fsm.stack[fsm.top] = next[h], fsm.phase = Phase::None;
+				pool.Move(h, next[h]);
+				pool.Publish(h, next[h]);
+				++changed;
+			}
+			return changed;
+		}
+
+	private:
+		// N is the max value of this enum class, aka the size.
+		static const int N = static_cast<int>(State::N);
+
+		// Alias table of state s is columns [offset[s], offset[s] + size[s]), column i holds
+		// target[i] with probability prob[i] / 2^32, or alias[i] otherwise.
+		int							offset[N] = {}, size[N] = {};
+		std::vector<std::uint32_t>	prob;
+		std::vector<int>			target, alias;
+		// Next states of a step, reused.
+		std::vector<int> next;
+
+		int Next(int s, std::uint64_t r) const
+		{
+			if (size[s] == 0)
+				return s;
+			// Column by the high half (Lemire's multiply-shift), coin by the low half.
+			auto i = offset[s] + static_cast<int>(((r >> 32) * static_cast<std::uint64_t>(size[s])) >> 32);
+			return static_cast<std::uint32_t>(r) < prob[i] ? target[i] : alias[i];
+		}
+
+		// Builds the alias table of state s by Vose's method.
+		void Build(int s, const std::vector<std::pair<int, float>>& edges)
+		{
+			int	   k = static_cast<int>(edges.size());
+			double sum = 0;
+			for (auto [to, w] : edges)
+			{
+				if (w < 0)
+					throw std::runtime_error("pdfsm: negative weight from " + std::to_string(s));
+				sum += w;
+			}
+			if (k == 0)
+				return;
+			if (sum <= 0)
+				throw std::runtime_error("pdfsm: zero weights from " + std::to_string(s));
+			offset[s] = static_cast<int>(prob.size()), size[s] = k;
+			std::vector<double> p(k);
+			std::vector<int>	small, large;
+			for (int i = 0; i < k; ++i)
+			{
+				p[i] = edges[i].second * k / sum;
+				(p[i] < 1 ? small : large).push_back(i);
+				target.push_back(edges[i].first), alias.push_back(edges[i].first);
+				prob.push_back(0);
+			}
+			auto column = [&](int i, double q) {
+				// Probability one never takes the alias.
+				prob[offset[s] + i] = q >= 1 ? std::numeric_limits<std::uint32_t>::max() : static_cast<std::uint32_t>(q * 4294967296.0);
+			};
+			while (!small.empty() && !large.empty())
+			{
+				int l = small.back(), g = large.back();
+				small.pop_back();
+				column(l, p[l]);
+				alias[offset[s] + l] = edges[g].first;
+				p[g] -= 1 - p[l];
+				if (p[g] < 1)
+					large.pop_back(), small.push_back(g);
+			}
+			// The rest are ones, by rounding errors.
+			for (auto i : large)
+				column(i, 1);
+			for (auto i : small)
+				column(i, 1);
+		}
+	};
+
+	//////////////////////
+	/// ActorRuntime
+	//////////////////////
+
+	// ActorRuntime runs the state machines of a pool as actors, on N worker threads.
+	// Each machine processes events posted to its inbox, the scheduler runs only machines
+	// having pending events, and a machine is never processed by two threads at once.
+	// There's no per-machine thread or timer, an idle machine costs nothing.
+	// Behaviors are bound to a handler, so each worker has its own handler made by a factory.
+	// Machines are handled within the pool, so locks, the membership index and scripts work
+	// as in batched updates, but they're never in the pool's active list, and Sleep does nothing.
+	// Features reading the membership index or calling hooks from the controlling thread,
+	// i.e. SignalRouter, RuleEngine or MarkovChain, should run while the runtime is idle (see WaitIdle).
+	template <EnumClass State>
+	class ActorRuntime
+	{
+	public:
+		using HandlerFactory = std::function<std::unique_ptr<StateMachineHandler<State>>()>;
+		// ErrorHandler is called on a worker thread with the exception thrown by the hooks
+		// processing an event of machine h, i.e. a transition to a locked state.
+		using ErrorHandler = std::function<void(Handle h, std::exception_ptr e)>;
+
+		// Where capacity is the max number of machines, which enables the pool's inboxes.
+		// The pool shouldn't be ticked by batched updates meanwhile.
+		ActorRuntime(StateMachinePool<State>& pool, EventPool& events, std::size_t capacity,
+			int nWorkers, const HandlerFactory& factory, Context ctx = Context())
+			: pool(pool), ctx(std::move(ctx)), control(factory())
+		{
+			assert(pool.runtime == nullptr);
+			pool.runtime = this;
+			pool.Reserve(capacity);
+			pool.EnableInbox(events, capacity);
+			for (int i = 0; i < nWorkers; ++i)
+				handlers.push_back(factory());
+			for (int i = 0; i < nWorkers; ++i)
+				workers.emplace_back([this, i]() { Work(*handlers[i]); });
+		}
+
+		~ActorRuntime()
+		{
+			Stop();
+			pool.runtime = nullptr;
+		}
+
+		// Spawns a new machine, which enters the initial state right away.
+		// Should be called from a single controlling thread.
+		// Throws a runtime_error beyond the capacity.
+		Handle Spawn(void)
+		{
+			auto h = pool.New();
+			control->SetHandlingFsm(pool, h, ctx);
+			control->ClearHandlingFsm();
+			return h;
+		}
+
+		// Sets the handler of exceptions thrown while processing events, the event is dropped
+		// and the machine goes on with the next one. Exceptions are ignored if it's not set.
+		// Should be called before any event is posted.
+		void SetErrorHandler(ErrorHandler handler) { onError = std::move(handler); }
+
+		// Posts an event to machine h, safe to call from any thread.
+		// Returns false if the event pool is exhausted.
+		bool Post(Handle h, Event event)
+		{
+			assert(h < pool.inboxCapacity);
+			auto n = pool.events->Acquire();
+			if (n == nullptr)
+				return false;
+			n->event = std::move(event);
+			auto& inbox = pool.inboxes[h];
+			inbox.events.Push(n);
+			// The one makes it non-zero schedules the machine.
+			if (inbox.pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+				Schedule(h);
+			return true;
+		}
+
+		// Frees machine h, should be called from the controlling thread, and no events should
+		// be posted to it meanwhile, or after. Throws a runtime_error if it has events pending,
+		// which a worker may be processing, i.e. it's safe after WaitIdle.
+		void Free(Handle h)
+		{
+			assert(h < pool.inboxCapacity);
+			pool.Free(h);
+		}
+
+		// Blocks until there's no machine to process.
+		void WaitIdle(void)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this]() { return runq.empty() && busy == 0; });
+		}
+
+		// Stops the workers after all scheduled machines are processed.
+		void Stop(void)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			cv.notify_all();
+			for (auto& w : workers)
+				if (w.joinable())
+					w.join();
+		}
+
+	private:
+		StateMachinePool<State>& pool;
+		Context					 ctx;
+		// Handler for the controlling thread, and handlers for workers.
+		std::unique_ptr<StateMachineHandler<State>>				 control;
+		std::vector<std::unique_ptr<StateMachineHandler<State>>> handlers;
+		std::vector<std::thread>								 workers;
+		ErrorHandler											 onError;
+		// Queue of machines to process, guarded by mutex.
+		std::deque<Handle>		runq;
+		std::mutex				mutex;
+		std::condition_variable cv, idle;
+		int						busy = 0;
+		bool					stopping = false;
+
+		void Schedule(Handle h)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				runq.push_back(h);
+			}
+			cv.notify_one();
+		}
+
+		void Work(StateMachineHandler<State>& h)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true)
+			{
+				cv.wait(lock, [this]() { return stopping || !runq.empty(); });
+				if (runq.empty())
+					return;
+				auto x = runq.front();
+				runq.pop_front();
+				++busy;
+				lock.unlock();
+				Process(h, x);
+				lock.lock();
+				if (--busy == 0 && runq.empty())
+					idle.notify_all();
+			}
+		}
+
+		// Processes the events of machine x, the worker owns x while its pending count is positive.
+		void Process(StateMachineHandler<State>& h, Handle x)
+		{
+			auto&	  inbox = pool.inboxes[x];
+			long long k = 0;
+			h.SetHandlingFsm(pool, x, ctx);
+			while (auto n = inbox.events.Pop())
+			{
+				try
+				{
+					h.Dispatch(ctx, n->event);
+				}
+				catch (...)
+				{
+					if (onError)
+						onError(x, std::current_exception());
+				}
+				pool.events->Release(n);
+				++k;
+			}
+			h.ClearHandlingFsm();
+			// Events arrived meanwhile (or being pushed), processes them later for fairness.
+			if (inbox.pending.fetch_sub(k, std::memory_order_acq_rel) - k > 0)
+				Schedule(x);
+		}
+	};
+
+	//////////////////////
+	/// Ticker
+	//////////////////////
+
+	// ManualClock is a clock only advanced by hand, for deterministic tests and replays.
+	class ManualClock
+	{
+	public:
+		using duration = std::chrono::nanoseconds;
+		using rep = duration::rep;
+		using period = duration::period;
+		using time_point = std::chrono::time_point<ManualClock>;
+		static const bool is_steady = true;
+
+		time_point now(void) const { return t; }
+		void	   Advance(duration d) { t += d; }
+
+	private:
+		time_point t;
+	};
+
+	// Ticker drives the ticking loop by a monotonic clock.
+	// Each tick advances ctx.seq and fills ctx.delta with the time elapsed.
+	// In fixed timestep mode, the elapsed time is accumulated and consumed by steps
+	// of a fixed delta, at most maxSteps per tick, and the rest is dropped.
+	template <typename Clock = std::chrono::steady_clock>
+	class Ticker
+	{
+	public:
+		explicit Ticker(Clock clock = Clock())
+			: clock(clock), last(this->clock.now()) {}
+
+		// Enables fixed timestep mode.
+		void SetFixedStep(std::chrono::nanoseconds s, int maxSteps = 5)
+		{
+			assert(s.count() > 0 && maxSteps > 0);
+			step = s, maxStepsPerTick = maxSteps, accumulator = {};
+		}
+
+		// Returns the clock, i.e. to advance a ManualClock.
+		Clock& GetClock(void) { return clock; }
+
+		// Returns the total time dropped by the catch-up cap.
+		std::chrono::nanoseconds Dropped(void) const { return dropped; }
+
+		// Ticks once, calls fn(ctx) for each step, returns the number of steps run.
+		template <typename Fn>
+		int Tick(Context& ctx, Fn&& fn)
+		{
+			auto now = clock.now();
+			auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last);
+			last = now;
+			if (step.count() == 0)
+			{
+				++ctx.seq, ctx.delta = elapsed;
+				fn(ctx);
+				return 1;
+			}
+			accumulator += elapsed;
+			int n = 0;
+			for (; accumulator >= step && n < maxStepsPerTick; ++n)
+			{
+				++ctx.seq, ctx.delta = step;
+				fn(ctx);
+				accumulator -= step;
+			}
+			if (accumulator >= step)
+			{
+				// Catch-up cap reached, drops the whole steps left.
+				auto rest = accumulator % step;
+				dropped += accumulator - rest;
+				accumulator = rest;
+			}
+			return n;
+		}
+
+		// Ticks once, drives batched updates over given pool.
+		template <EnumClass State>
+		int Tick(Context& ctx, StateMachineHandler<State>& h, StateMachinePool<State>& pool)
+		{
+			return Tick(ctx, [&](const Context& c) { h.Update(pool, c); });
+		}
+
+	private:
+		Clock					   clock;
+		typename Clock::time_point last;
+		// Fixed timestep, zero for variable timestep mode.
+		std::chrono::nanoseconds step{ 0 }, accumulator{ 0 }, dropped{ 0 };
+		int						 maxStepsPerTick = 0;
 	};
 } // namespace Pdfsm
 
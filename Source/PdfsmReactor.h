@@ -0,0 +1,108 @@
+// Copyright (c) 2024 Chao Wang <hit9@icloud.com>.
+// License: BSD. https://github.com/hit9/pdfsm.h
+
+// An optional Linux reactor that advances state machines on file descriptors readiness.
+//
+// 1. File descriptors are registered for machines in a pool, edge-triggered.
+// 2. Poll waits by epoll, and calls the OnReady hook of each ready machine's current state.
+// 3. The cost is proportional to the number of I/O events, instead of connections.
+//
+// Requires: C++20, Linux
+
+#ifndef HIT9_PDFSM_REACTOR_H
+#define HIT9_PDFSM_REACTOR_H
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+#include <vector>
+
+#include "Pdfsm.h"
+
+namespace Pdfsm
+{
+
+	//////////////////////
+	/// Reactor
+	//////////////////////
+
+	template <EnumClass State>
+	class Reactor
+	{
+	public:
+		// Where maxEvents is the max number of events handled by a single Poll.
+		Reactor(StateMachineHandler<State>& handler, StateMachinePool<State>& pool, int maxEvents = 256)
+			: handler(handler), pool(pool), events(maxEvents)
+		{
+			epfd = epoll_create1(EPOLL_CLOEXEC);
+			if (epfd == -1)
+				throw std::system_error(errno, std::system_category(), "pdfsm: epoll_create1");
+		}
+
+		Reactor(const Reactor&) = delete;
+
+		~Reactor() { close(epfd); }
+
+		// Registers a file descriptor for machine h, edge-triggered.
+		// The fd should be non-blocking, and the hook should read or write until EAGAIN.
+		void Register(Handle h, int fd, std::uint32_t interests = EPOLLIN | EPOLLOUT | EPOLLRDHUP)
+		{
+			Control(EPOLL_CTL_ADD, h, fd, interests);
+		}
+
+		// Modifies the interests of a registered file descriptor.
+		void Modify(Handle h, int fd, std::uint32_t interests)
+		{
+			Control(EPOLL_CTL_MOD, h, fd, interests);
+		}
+
+		// Unregisters a file descriptor, should be called before closing it.
+		void Unregister(int fd)
+		{
+			if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr) == -1)
+				throw std::system_error(errno, std::system_category(), "pdfsm: epoll_ctl");
+		}
+
+		// Waits for at most timeout milliseconds (-1 for infinite), and calls the OnReady hook of
+		// the current state of each ready machine. Returns the number of events handled.
+		int Poll(const Context& ctx, int timeout)
+		{
+			int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), timeout);
+			if (n == -1)
+			{
+				if (errno == EINTR)
+					return 0;
+				throw std::system_error(errno, std::system_category(), "pdfsm: epoll_wait");
+			}
+			for (int i = 0; i < n; ++i)
+			{
+				auto h = static_cast<Handle>(events[i].data.u64 >> 32);
+				auto fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+				handler.SetHandlingFsm(pool, h, ctx);
+				handler.Ready(ctx, fd, events[i].events);
+			}
+			handler.ClearHandlingFsm();
+			return n;
+		}
+
+	private:
+		StateMachineHandler<State>& handler;
+		StateMachinePool<State>&	pool;
+		int							epfd;
+		std::vector<epoll_event>	events;
+
+		void Control(int op, Handle h, int fd, std::uint32_t interests)
+		{
+			epoll_event ev{};
+			ev.events = interests | EPOLLET;
+			// Packs the handle and fd, so no lookup is needed on readiness.
+			ev.data.u64 = static_cast<std::uint64_t>(h) << 32 | static_cast<std::uint32_t>(fd);
+			if (epoll_ctl(epfd, op, fd, &ev) == -1)
+				throw std::system_error(errno, std::system_category(), "pdfsm: epoll_ctl");
+		}
+	};
+} // namespace Pdfsm
+
+#endif
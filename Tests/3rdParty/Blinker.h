@@ -27,6 +27,14 @@
 //    2. The backend buffer is for new signal emittings.
 //    3. The two should be flipped on each tick.
 //    4. Each buffer owns a signature of fired signals.
+//    5. Each buffer appends events into a contiguous arena, which is reused across frames.
+//       A trivially copyable data no larger than InlinePayloadSize is stored inline, without std::any.
+// 8. Producers emit signals from other threads without locks. Each producer owns a
+//    single-producer single-consumer ring, which is merged into the backend buffer on
+//    Flip, in producers' creation order.
+// 9. Signatures of many connections can be matched against fired signals at once, by a
+//    SignatureSet, which stores signatures in 64-bit word columns, so the AND operations
+//    are vectorized across connections, and only the words having fired signals are visited.
 //
 // Code Overview
 // ~~~~~~~~~~~~~
@@ -45,12 +53,19 @@
 //
 //      auto connection = board.Connect({"x.*"}); // a unique pointer
 //
+//   4. Creates a producer for each emitting thread (optional):
+//
+//      auto producer = board.NewProducer(); // owned by the board
+//
 // Runtime stages:
 //
 //   1. Emits a signal (to the backend buffer):
 //
 //      a->Emit(123);
 //
+//      // Or from another thread, returns false if the producer's ring is full.
+//      producer->Emit(a->Id(), 123);
+//
 //   2. In the ticking loop:
 //
 //      while(true) {
@@ -60,23 +75,38 @@
 //          // executes if any signals fired
 //        });
 //
+//        // Or, poll without boxing inline data into std::any.
+//        connection->PollPayload([&](const Blinker::SignalId id, const Blinker::Payload& data) {
+//          auto v = data.As<int>();
+//        });
+//
+//        // Or, match a whole set of signatures at once, and get (connection, signal id) hits.
+//        board.MatchAll(signatureSet, hits);
+//
 //        // Flip double buffers.
 //        board.Flip();
 //      }
 
-// Version: 0.2.0
+// Version: 0.3.0
 
 #ifndef HIT9_BLINKER_H
 #define HIT9_BLINKER_H
 
 #include <any>
+#include <atomic>
 #include <bitset>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <algorithm>
+#include <cstring>
 #include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -100,6 +130,64 @@ namespace Blinker
 	// Callback function to be executed on subscribed signal fired.
 	using Callback = std::function<void(SignalId, std::any)>;
 
+	// Max size of a signal data stored inline in buffers.
+	static const std::size_t InlinePayloadSize = 32;
+
+	// Whether a data of type T is stored inline in buffers, without std::any.
+	template <typename T>
+	inline constexpr bool IsInlinePayload = std::is_trivially_copyable_v<T> && !std::is_array_v<T>
+		&& sizeof(T) <= InlinePayloadSize && alignof(T) <= alignof(std::max_align_t);
+
+	// Boxer converts an inline data to std::any.
+	using Boxer = std::any (*)(const void*);
+
+	template <typename T>
+	std::any Box(const void* p) { return std::any(*std::launder(reinterpret_cast<const T*>(p))); }
+
+	// Payload is a view of a fired signal's data, valid only inside a poll callback.
+	class Payload
+	{
+	public:
+		Payload(const void* bytes, Boxer box, const std::any* any)
+			: bytes(bytes), box(box), any(any) {}
+
+		// Whether the data is stored inline.
+		bool IsInline() const { return box != nullptr; }
+
+		// Returns the inline data as T, which must be the type emitted.
+		template <typename T>
+		const T& As() const
+		{
+			assert(IsInline());
+			return *std::launder(reinterpret_cast<const T*>(bytes));
+		}
+
+		// Returns the data as std::any, an inline data is boxed.
+		std::any ToAny() const { return IsInline() ? box(bytes) : *any; }
+
+	private:
+		const void*		bytes;
+		Boxer			box;
+		const std::any* any;
+	};
+
+	// Callback function to be executed on subscribed signal fired, with a payload view.
+	using PayloadCallback = std::function<void(SignalId, const Payload&)>;
+
+	// Number of 64-bit words of a signature.
+	template <std::size_t N>
+	inline constexpr std::size_t NWords = (N + 63) / 64;
+
+	// Hit is a signal id matched by the connection (index) of a SignatureSet.
+	struct Hit
+	{
+		std::uint32_t connection;
+		SignalId	  id;
+	};
+
+	// util function to count trailing zeros of a non-zero word.
+	static inline int Ctz(std::uint64_t x);
+
 	// util function to split string into parts by given delimiter.
 	static void Split(std::string_view s, std::vector<std::string>& parts, char delimiter);
 
@@ -130,6 +218,9 @@ namespace Blinker
 		SignalId id = 0;
 	};
 
+	// A Buffer stores the events fired during a frame.
+	// Events are appended into a contiguous arena, and chained by signal id in emitting order.
+	// Clearing and polling cost O(fired), and the memory is reused across frames.
 	template <size_t N = DefaultNSignal>
 	class Buffer
 	{
@@ -142,14 +233,53 @@ namespace Blinker
 		// Emits a signal by id and data.
 		void Emit(SignalId id, std::any data);
 
+		// Emits a signal by id and an inline data of given size.
+		void Emit(SignalId id, const void* data, std::size_t size, Boxer box);
+
 		// Poll fired signals matching given signature.
-		int Poll(const Signature<N>& signature, const Callback& cb, SignalId maxId);
+		int Poll(const Signature<N>& signature, const Callback& cb);
+
+		// Poll fired signals matching given signature, with payload views.
+		int Poll(const Signature<N>& signature, const PayloadCallback& cb);
+
+		// Returns the signature of fired signals.
+		const Signature<N>& Fired() const { return fired; }
+
+		// Returns the signature of fired signals, in 64-bit words.
+		const std::uint64_t* FiredWords() const { return words; }
 
 	private:
+		static const std::uint32_t End = UINT32_MAX;
+
+		struct Event
+		{
+			alignas(std::max_align_t) unsigned char bytes[InlinePayloadSize];
+			// Boxer of the inline data, nullptr if the data is anys[index].
+			Boxer		  box;
+			std::uint32_t index;
+			// Next event of the same signal id.
+			std::uint32_t next;
+		};
+
 		// A signature stores all ids of fired signals.
 		Signature<N> fired;
-		// d[j] collects the data for fired signal j.
-		std::unordered_map<SignalId, std::vector<std::any>> d;
+		// The same signature in 64-bit words.
+		std::uint64_t words[NWords<N>] = {};
+		// Ids of fired signals, sorted on polling.
+		std::vector<SignalId> ids;
+		bool				  sorted = true;
+		// Events arena of this frame.
+		std::vector<Event> events;
+		// head[j] and tail[j] are the first and last event of fired signal j.
+		std::uint32_t head[N], tail[N];
+		// Data emitted as std::any.
+		std::vector<std::any> anys;
+
+		// Appends an event for given signal id.
+		Event& Append(SignalId id);
+		// Calls fn(id, payload) for each event matching given signature.
+		template <typename Fn>
+		int ForEach(const Signature<N>& signature, Fn&& fn);
 	};
 
 	class IBoardEmitter
@@ -157,6 +287,8 @@ namespace Blinker
 	public:
 		// Emits a signal to backend buffer by signal id.
 		virtual void Emit(SignalId id, std::any data) = 0;
+		// Emits a signal to backend buffer by signal id, with an inline data.
+		virtual void Emit(SignalId id, const void* data, std::size_t size, Boxer box) = 0;
 	};
 
 	template <std::size_t N = DefaultNSignal>
@@ -165,6 +297,8 @@ namespace Blinker
 	public:
 		// Poll fired signals matching given signature from frontend buffer.
 		virtual int Poll(const Signature<N>& signature, Callback& cb) = 0;
+		// Poll fired signals matching given signature from frontend buffer, with payload views.
+		virtual int PollPayload(const Signature<N>& signature, const PayloadCallback& cb) = 0;
 	};
 
 	class Signal
@@ -180,6 +314,10 @@ namespace Blinker
 		// Emits this signal.
 		void Emit(std::any data) { board->Emit(id, data); }
 
+		// Emits this signal with a data stored inline, without std::any.
+		template <typename T, std::enable_if_t<IsInlinePayload<T>, int> = 0>
+		void Emit(const T& data) { board->Emit(id, &data, sizeof(T), &Box<T>); }
+
 	private:
 		std::string	   name;
 		const SignalId id;
@@ -200,6 +338,12 @@ namespace Blinker
 		int		   Poll(Callback& cb) { return board->Poll(signature, cb); }
 		inline int Poll(Callback&& cb) { return board->Poll(signature, cb); }
 
+		// Poll for subscribed signals, with payload views.
+		int PollPayload(const PayloadCallback& cb) { return board->PollPayload(signature, cb); }
+
+		// Returns the signature of connected signals.
+		const Signature<N>& GetSignature() const { return signature; }
+
 	private:
 		// Signal ids connected.
 		const Signature<N> signature;
@@ -207,6 +351,75 @@ namespace Blinker
 		IBoardPoller<N>* board;
 	};
 
+	template <size_t N>
+	class Board;
+
+	// A Producer emits signals to a board from a single thread, without locks.
+	// Events are staged in a bounded single-producer single-consumer ring, and
+	// merged into the board's backend buffer on Flip.
+	template <size_t N = DefaultNSignal>
+	class Producer
+	{
+	public:
+		// The capacity is rounded up to a power of 2.
+		explicit Producer(std::size_t capacity);
+
+		// Emits a signal by id and data, returns false if the ring is full.
+		bool Emit(SignalId id, std::any data);
+
+		// Emits a signal by id with a data stored inline, returns false if the ring is full.
+		template <typename T, std::enable_if_t<IsInlinePayload<T>, int> = 0>
+		bool Emit(SignalId id, const T& data);
+
+	private:
+		struct Slot
+		{
+			alignas(std::max_align_t) unsigned char bytes[InlinePayloadSize];
+			// Boxer of the inline data, nullptr if the data is any.
+			Boxer	 box;
+			SignalId id;
+			std::any any;
+		};
+
+		std::vector<Slot> slots;
+		std::size_t		  mask;
+		// Written by the producer thread.
+		alignas(64) std::atomic<std::size_t> tail{ 0 };
+		std::size_t cachedHead = 0;
+		// Written by the flipping thread.
+		alignas(64) std::atomic<std::size_t> head{ 0 };
+
+		// Returns the slot to write, nullptr if the ring is full.
+		Slot* Reserve();
+		// Publishes the slot reserved.
+		void Commit() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+		// Moves staged events into given buffer.
+		void Drain(Buffer<N>& buffer);
+
+		friend class Board<N>;
+	};
+
+	// A SignatureSet stores the signatures of many connections, to be matched at once.
+	// Signatures are stored in 64-bit word columns, columns[k][c] is the k'th word
+	// of the c'th signature, so that matching is vectorized across connections.
+	template <size_t N = DefaultNSignal>
+	class SignatureSet
+	{
+	public:
+		// Adds a signature, returns its index.
+		std::uint32_t Add(const Signature<N>& signature);
+		std::uint32_t Add(const Connection<N>& connection) { return Add(connection.GetSignature()); }
+
+		std::size_t Size() const { return columns[0].size(); }
+
+	private:
+		std::vector<std::uint64_t> columns[NWords<N>];
+		// Reused buffer of matching masks.
+		std::vector<std::uint64_t> masks;
+
+		friend class Board<N>;
+	};
+
 	// The board of signals.
 	// Where the N is at least (the max number of signals in this board + 1).
 	template <size_t N = DefaultNSignal>
@@ -230,9 +443,28 @@ namespace Blinker
 
 		// Emits a signal to backend buffer by signal id.
 		void Emit(SignalId id, std::any data) override final;
+		void Emit(SignalId id, const void* data, std::size_t size, Boxer box) override final;
 
 		// Poll fired signals matching given signature from frontend buffer.
-		int Poll(const Signature<N>& signature, Callback& cb) override final;
+		int		   Poll(const Signature<N>& signature, Callback& cb) override final;
+		inline int Poll(const Signature<N>& signature, Callback&& cb) { return Poll(signature, cb); }
+		int		   PollPayload(const Signature<N>& signature, const PayloadCallback& cb) override final;
+
+		// Returns the signature of fired signals in the frontend buffer.
+		const Signature<N>& Fired(void) const { return frontend->Fired(); }
+
+		// Returns the signature of signals matching given pattern list.
+		Signature<N> Match(const std::vector<std::string_view>& patterns) const;
+
+		// Matches fired signals in frontend buffer against all signatures of given set at once.
+		// Collects (connection index, signal id) hits, ordered by connection and then signal id.
+		// Returns the number of connections matched.
+		int MatchAll(SignatureSet<N>& set, std::vector<Hit>& hits) const;
+
+		// Creates a producer to emit signals from another thread, owned by this board.
+		// On Flip, events from producers are merged after the ones emitted directly,
+		// in producers' creation order, and then each producer's emitting order.
+		[[nodiscard]] Producer<N>* NewProducer(std::size_t capacity = 4096);
 
 		// Flips the internal double buffers.
 		void Flip(void);
@@ -247,12 +479,30 @@ namespace Blinker
 		SignalTrie<N> tree;
 		// Double buffers.
 		std::unique_ptr<Buffer<N>> frontend, backend;
+		// Producers in creation order, guarded by mutex.
+		std::vector<std::unique_ptr<Producer<N>>> producers;
+		std::mutex								  mutex;
+
+		// Merges events staged by producers into the backend buffer.
+		void Merge(void);
 	};
 
 	//////////////////////////////
 	/// Implementations
 	//////////////////////////////
 
+	static inline int Ctz(std::uint64_t x)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(x);
+#else
+		int n = 0;
+		for (; !(x & 1); x >>= 1)
+			++n;
+		return n;
+#endif
+	}
+
 	static void Split(std::string_view s, std::vector<std::string>& parts, char delimiter)
 	{
 		parts.emplace_back();
@@ -328,39 +578,161 @@ namespace Blinker
 	template <size_t N>
 	void Buffer<N>::Clear()
 	{
-		fired.reset();
+		// Only need to clear fired signals, the capacities are kept.
+		for (auto id : ids)
+			fired[id] = 0, words[id >> 6] = 0;
+		ids.clear();
+		events.clear();
+		anys.clear();
+		sorted = true;
+	}
 
-		// Only need to clear data for fired signals.
-		for (int i = 0; i < N; ++i)
+	template <size_t N>
+	typename Buffer<N>::Event& Buffer<N>::Append(SignalId id)
+	{
+		auto i = static_cast<std::uint32_t>(events.size());
+		auto& e = events.emplace_back();
+		e.next = End;
+		if (fired[id])
+			events[tail[id]].next = i;
+		else
 		{
-			if (fired[i])
-			{
-				d[i].clear();
-			}
+			fired[id] = 1, head[id] = i;
+			words[id >> 6] |= std::uint64_t(1) << (id & 63);
+			if (!ids.empty() && ids.back() > id)
+				sorted = false;
+			ids.push_back(id);
 		}
+		tail[id] = i;
+		return e;
 	}
 
 	template <size_t N>
 	void Buffer<N>::Emit(SignalId id, std::any data)
 	{
-		fired[id] = 1, d[id].push_back(data);
+		auto& e = Append(id);
+		e.box = nullptr;
+		e.index = static_cast<std::uint32_t>(anys.size());
+		anys.push_back(std::move(data));
+	}
+
+	template <size_t N>
+	void Buffer<N>::Emit(SignalId id, const void* data, std::size_t size, Boxer box)
+	{
+		assert(size <= InlinePayloadSize);
+		auto& e = Append(id);
+		e.box = box;
+		std::memcpy(e.bytes, data, size);
 	}
 
 	template <size_t N>
-	int Buffer<N>::Poll(const Signature<N>& signature, const Callback& cb, SignalId maxId)
+	template <typename Fn>
+	int Buffer<N>::ForEach(const Signature<N>& signature, Fn&& fn)
 	{
-		auto match = signature & fired;
+		if (!sorted)
+			std::sort(ids.begin(), ids.end()), sorted = true;
 
-		for (int i = 1; i < maxId; i++)
+		int n = 0;
+		for (auto id : ids)
 		{
-			if (!match[i])
+			if (!signature[id])
 				continue;
+			++n;
 			// a signal may emit for multiple times during a frame.
-			for (int j = 0; j < d[i].size(); ++j)
-				cb(i, d[i][j]);
+			for (auto i = head[id]; i != End; i = events[i].next)
+			{
+				const auto& e = events[i];
+				fn(id, Payload(e.bytes, e.box, e.box == nullptr ? &anys[e.index] : nullptr));
+			}
+		}
+		return n;
+	}
+
+	template <size_t N>
+	int Buffer<N>::Poll(const Signature<N>& signature, const Callback& cb)
+	{
+		return ForEach(signature, [&](SignalId id, const Payload& p) { cb(id, p.ToAny()); });
+	}
+
+	template <size_t N>
+	int Buffer<N>::Poll(const Signature<N>& signature, const PayloadCallback& cb)
+	{
+		return ForEach(signature, cb);
+	}
+
+	template <size_t N>
+	Producer<N>::Producer(std::size_t capacity)
+	{
+		std::size_t n = 1;
+		while (n < capacity)
+			n <<= 1;
+		slots.resize(n);
+		mask = n - 1;
+	}
+
+	template <size_t N>
+	typename Producer<N>::Slot* Producer<N>::Reserve()
+	{
+		auto t = tail.load(std::memory_order_relaxed);
+		if (t - cachedHead == slots.size())
+		{
+			cachedHead = head.load(std::memory_order_acquire);
+			if (t - cachedHead == slots.size())
+				return nullptr;
+		}
+		return &slots[t & mask];
+	}
+
+	template <size_t N>
+	bool Producer<N>::Emit(SignalId id, std::any data)
+	{
+		auto slot = Reserve();
+		if (slot == nullptr)
+			return false;
+		slot->id = id, slot->box = nullptr, slot->any = std::move(data);
+		Commit();
+		return true;
+	}
+
+	template <size_t N>
+	template <typename T, std::enable_if_t<IsInlinePayload<T>, int>>
+	bool Producer<N>::Emit(SignalId id, const T& data)
+	{
+		auto slot = Reserve();
+		if (slot == nullptr)
+			return false;
+		slot->id = id, slot->box = &Box<T>;
+		std::memcpy(slot->bytes, &data, sizeof(T));
+		Commit();
+		return true;
+	}
+
+	template <size_t N>
+	void Producer<N>::Drain(Buffer<N>& buffer)
+	{
+		auto h = head.load(std::memory_order_relaxed);
+		auto t = tail.load(std::memory_order_acquire);
+		for (; h != t; ++h)
+		{
+			auto& slot = slots[h & mask];
+			if (slot.box != nullptr)
+				buffer.Emit(slot.id, slot.bytes, InlinePayloadSize, slot.box);
+			else
+				buffer.Emit(slot.id, std::move(slot.any));
 		}
+		head.store(h, std::memory_order_release);
+	}
 
-		return match.count();
+	template <size_t N>
+	std::uint32_t SignatureSet<N>::Add(const Signature<N>& signature)
+	{
+		auto c = static_cast<std::uint32_t>(Size());
+		for (auto& column : columns)
+			column.push_back(0);
+		for (std::size_t i = 0; i < N; ++i)
+			if (signature[i])
+				columns[i >> 6][c] |= std::uint64_t(1) << (i & 63);
+		return c;
 	}
 
 	template <size_t N>
@@ -398,13 +770,64 @@ namespace Blinker
 
 	template <size_t N>
 	std::unique_ptr<Connection<N>> Board<N>::Connect(const std::vector<std::string_view>& patterns)
+	{
+		return std::make_unique<Connection<N>>(Match(patterns), this);
+	}
+
+	template <size_t N>
+	Signature<N> Board<N>::Match(const std::vector<std::string_view>& patterns) const
 	{
 		Signature<N> signature;
 		for (const auto& pattern : patterns)
 		{
 			signature |= tree.Match(pattern); // cppcheck-suppress useStlAlgorithm
 		}
-		return std::make_unique<Connection<N>>(signature, this);
+		return signature;
+	}
+
+	template <size_t N>
+	int Board<N>::MatchAll(SignatureSet<N>& set, std::vector<Hit>& hits) const
+	{
+		hits.clear();
+		const auto* fired = frontend->FiredWords();
+
+		// Only words having fired signals are visited.
+		std::size_t ks[NWords<N>], nk = 0;
+		for (std::size_t k = 0; k < NWords<N>; ++k)
+			if (fired[k])
+				ks[nk++] = k;
+		if (nk == 0)
+			return 0;
+
+		// Pass 1: AND each column with the fired word, vectorized across connections.
+		auto  size = set.Size();
+		auto& masks = set.masks;
+		masks.assign(size, 0);
+		auto* m = masks.data();
+		for (std::size_t i = 0; i < nk; ++i)
+		{
+			const auto* column = set.columns[ks[i]].data();
+			const auto	f = fired[ks[i]];
+			for (std::size_t c = 0; c < size; ++c)
+				m[c] |= column[c] & f;
+		}
+
+		// Pass 2: collects hits of matched connections only.
+		int matched = 0;
+		for (std::size_t c = 0; c < size; ++c)
+		{
+			if (!m[c])
+				continue;
+			++matched;
+			for (std::size_t i = 0; i < nk; ++i)
+			{
+				auto bits = set.columns[ks[i]][c] & fired[ks[i]];
+				for (; bits; bits &= bits - 1)
+					hits.push_back({ static_cast<std::uint32_t>(c),
+						static_cast<SignalId>(ks[i] * 64 + Ctz(bits)) });
+			}
+		}
+		return matched;
 	}
 
 	template <size_t N>
@@ -413,16 +836,44 @@ namespace Blinker
 		backend->Emit(id, data);
 	}
 
+	template <size_t N>
+	void Board<N>::Emit(SignalId id, const void* data, std::size_t size, Boxer box)
+	{
+		backend->Emit(id, data, size, box);
+	}
+
 	template <size_t N>
 	int Board<N>::Poll(const Signature<N>& signature, Callback& cb)
 	{
-		return frontend->Poll(signature, cb, nextId);
+		return frontend->Poll(signature, cb);
 	}
 
 	template <size_t N>
-	void Board<N>::Flip(void)
+	int Board<N>::PollPayload(const Signature<N>& signature, const PayloadCallback& cb)
+	{
+		return frontend->Poll(signature, cb);
+	}
+
+	template <size_t N>
+	Producer<N>* Board<N>::NewProducer(std::size_t capacity)
 	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return producers.emplace_back(std::make_unique<Producer<N>>(capacity)).get();
+	}
 
+	template <size_t N>
+	void Board<N>::Merge(void)
+	{
+		// Only contends with NewProducer, never with emitting.
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& producer : producers)
+			producer->Drain(*backend);
+	}
+
+	template <size_t N>
+	void Board<N>::Flip(void)
+	{
+		Merge();
 		frontend->Clear();
 		std::swap(frontend, backend);
 	}
@@ -430,6 +881,7 @@ namespace Blinker
 	template <size_t N>
 	void Board<N>::Clear(void)
 	{
+		Merge();
 		frontend->Clear();
 		backend->Clear();
 	}
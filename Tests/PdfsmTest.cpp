@@ -1,5 +1,15 @@
 #include "Pdfsm.h"
 
+#include <coroutine>
+#include <thread>
+
+#ifdef __linux__
+	#include "PdfsmReactor.h"
+
+	#include <sys/socket.h>
+	#include <unistd.h>
+#endif
+
 #include <catch2/catch_test_macros.hpp>
 
 #include "States.h"
@@ -77,33 +87,41 @@ TEST_CASE("Pdfsm/4", "[Signal]")
 	signalBoard.Clear();
 	auto						  bb = std::make_shared<Blackboard>();
 	auto						  ctx = Pdfsm::Context(bb);
-	Pdfsm::StateMachine<S>		  fsm;
+	Pdfsm::StateMachinePool<S>	  pool;
 	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
-	h.SetHandlingFsm(fsm, ctx);
+	auto						  x = pool.New();
+	auto route = [&]() {
+		return signalRouter.Route(h, pool, ctx, signalBoard.Fired(),
+			[](const auto& signature, auto&& cb) { signalBoard.Poll(signature, cb); });
+	};
+	h.SetHandlingFsm(pool, x, ctx);
 
 	// inits to A
 	REQUIRE(bb->onEnterCounterA == 1);
+	h.ClearHandlingFsm();
 	// Emit signal x and instant Flip.
 	signals.x->Emit(0);
 	signalBoard.Flip();
-	// Update
-	h.Update(ctx);
-	REQUIRE(bb->updateCounterA == 0); // A misses this update.
+	// Signals are routed, not polled on update.
+	REQUIRE(route() == 1);
+	REQUIRE(bb->updateCounterA == 0);
 	// Should jump to B.
-	REQUIRE(h.Top() == S::B);
+	REQUIRE(pool[x].stack[pool[x].top] == static_cast<int>(S::B));
 	// Emit signal z.
 	signals.z->Emit(0);
 	signalBoard.Flip();
-	h.Update(ctx);
-	REQUIRE(bb->updateCounterB == 0); // B misses this update.
+	REQUIRE(route() == 1);
 	// Should jump to C.
-	REQUIRE(h.Top() == S::C);
-
-	h.ClearHandlingFsm();
+	REQUIRE(pool[x].stack[pool[x].top] == static_cast<int>(S::C));
+	// Updating doesn't handle the fired signals again.
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterC == 1);
+	REQUIRE(pool[x].stack[pool[x].top] == static_cast<int>(S::C));
 }
 
 TEST_CASE("Pdfsm/5", "[Multiple fsm]")
 {
+	signalBoard.Clear();
 	auto						  bb = std::make_shared<Blackboard>();
 	auto						  ctx = Pdfsm::Context(bb);
 	Entity						  e1, e2;
@@ -141,3 +159,1518 @@ TEST_CASE("Pdfsm/5", "[Multiple fsm]")
 	REQUIRE(bb->updateCounterC == 2);
 	h.ClearHandlingFsm();
 }
+
+TEST_CASE("Pdfsm/6", "[Dormant]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	auto						  h1 = pool.New(), h2 = pool.New(), h3 = pool.New();
+	REQUIRE(pool.Size() == 3);
+	REQUIRE(pool.NumActive() == 3);
+	// all inits to A
+	h.Update(pool, ctx);
+	REQUIRE(bb->onEnterCounterA == 3);
+	REQUIRE(bb->updateCounterA == 3);
+	// h1 jumps to C, and C falls asleep on update.
+	bb->sleepTicksC = 0;
+	h.SetHandlingFsm(pool, h1, ctx);
+	h.Jump(ctx, S::C);
+	h.ClearHandlingFsm();
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterC == 1);
+	REQUIRE(bb->updateCounterA == 5);
+	REQUIRE(pool.IsDormant(h1));
+	REQUIRE(pool.NumActive() == 2);
+	// h1 is skipped.
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterC == 1);
+	REQUIRE(bb->updateCounterA == 7);
+	// Explicit wake up.
+	pool.Wake(h1);
+	REQUIRE(!pool.IsDormant(h1));
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterC == 2);
+	REQUIRE(pool.IsDormant(h1));
+	// Sleeps for 2 ticks.
+	bb->sleepTicksC = 2;
+	pool.Wake(h1);
+	h.Update(pool, ctx); // C: 3, sleeps
+	h.Update(pool, ctx); // skipped
+	REQUIRE(bb->updateCounterC == 3);
+	h.Update(pool, ctx); // timer fires, C: 4, sleeps again
+	REQUIRE(bb->updateCounterC == 4);
+	// An explicit wake cancels the timer.
+	pool.Wake(h1);
+	bb->sleepTicksC = 0;
+	h.Update(pool, ctx); // C: 5, sleeps forever
+	h.Update(pool, ctx);
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterC == 5);
+	// Free and reuse.
+	pool.Free(h2);
+	REQUIRE(pool.Size() == 2);
+	REQUIRE(pool.NumActive() == 1);
+	auto h4 = pool.New();
+	REQUIRE(h4 == h2);
+	REQUIRE(pool[h4].top == -1);
+	REQUIRE(h3 != h4);
+	// Hooks sleeping or freeing an updated fsm don't make the rest miss the tick.
+	bb->sleepTicksC = -1;
+	for (auto free : { false, true })
+	{
+		Pdfsm::StateMachinePool<S> pool2;
+		auto					   m1 = pool2.New(), m2 = pool2.New(), m3 = pool2.New(), m4 = pool2.New();
+		h.SetHandlingFsm(pool2, m2, ctx);
+		h.Jump(ctx, S::C);
+		h.ClearHandlingFsm();
+		bb->onUpdateC = [&]() { free ? pool2.Free(m1) : pool2.Sleep(m1); };
+		auto a = bb->updateCounterA;
+		h.Update(pool2, ctx); // m4 is moved after m1 is removed.
+		REQUIRE(bb->updateCounterA == a + 3);
+		REQUIRE(pool2.NumActive() == 3);
+		REQUIRE(!pool2.IsDormant(m3));
+		REQUIRE(!pool2.IsDormant(m4));
+		bb->onUpdateC = nullptr;
+		h.Update(pool2, ctx);
+		REQUIRE(bb->updateCounterA == a + 5);
+	}
+}
+
+TEST_CASE("Pdfsm/7", "[Budgeted update]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	for (int i = 0; i < 5; i++)
+		pool.New();
+	Pdfsm::UpdateBudget budget;
+	budget.maxMachines = 2;
+	// Tick 1: machines 0, 1
+	auto stats = h.Update(pool, ctx, budget);
+	REQUIRE(stats.updated == 2);
+	REQUIRE(stats.skipped == 3);
+	REQUIRE(stats.maxStaleness == 1);
+	REQUIRE(bb->updateCounterA == 2);
+	// Tick 2: machines 2, 3
+	stats = h.Update(pool, ctx, budget);
+	REQUIRE(stats.updated == 2);
+	REQUIRE(stats.maxStaleness == 2);
+	// Tick 3: machines 4, 0, and 1, 2, 3 are left
+	stats = h.Update(pool, ctx, budget);
+	REQUIRE(stats.updated == 2);
+	REQUIRE(stats.skipped == 3);
+	REQUIRE(stats.maxStaleness == 3);
+	REQUIRE(bb->updateCounterA == 6);
+	// Unlimited budget updates each machine once.
+	stats = h.Update(pool, ctx, Pdfsm::UpdateBudget{});
+	REQUIRE(stats.updated == 5);
+	REQUIRE(stats.skipped == 0);
+	REQUIRE(bb->updateCounterA == 11);
+	// Time budget.
+	budget.maxMachines = 0;
+	budget.maxTime = std::chrono::hours(1);
+	stats = h.Update(pool, ctx, budget);
+	REQUIRE(stats.updated == 5);
+	REQUIRE(stats.maxStaleness == 1);
+
+	// Falling asleep doesn't push the rest of the round to the next one.
+	Pdfsm::StateMachinePool<S> pool2;
+	std::vector<Pdfsm::Handle> hs;
+	for (int i = 0; i < 5; i++)
+		hs.push_back(pool2.New());
+	h.Update(pool2, ctx);
+	h.SetHandlingFsm(pool2, hs[4], ctx);
+	h.Jump(ctx, S::B);
+	budget.maxMachines = 1;
+	budget.maxTime = std::chrono::nanoseconds(0);
+	h.Update(pool2, ctx, budget); // machine 0
+	pool2.Sleep(hs[0]);
+	int updateCounterB = bb->updateCounterB;
+	h.Update(pool2, ctx, budget); // machine 4, swapped into the round
+	REQUIRE(bb->updateCounterB == updateCounterB + 1);
+	for (int i = 0; i < 3; i++)
+		h.Update(pool2, ctx, budget); // machines 1, 2, 3
+	REQUIRE(bb->updateCounterB == updateCounterB + 1);
+	stats = h.Update(pool2, ctx, budget); // next round
+	REQUIRE(bb->updateCounterB == updateCounterB + 2);
+	REQUIRE(stats.skipped == 3);
+	REQUIRE(stats.maxStaleness == 4);
+
+	// Machines falling asleep during the update aren't skipped.
+	Pdfsm::StateMachinePool<S> pool3;
+	for (int i = 0; i < 4; i++)
+	{
+		h.SetHandlingFsm(pool3, pool3.New(), ctx);
+		h.Jump(ctx, S::C);
+	}
+	bb->sleepTicksC = 0;
+	budget.maxMachines = 2;
+	stats = h.Update(pool3, ctx, budget);
+	REQUIRE(stats.updated == 2);
+	REQUIRE(pool3.NumActive() == 2);
+	REQUIRE(stats.skipped == 2);
+	REQUIRE(stats.maxStaleness == 1);
+	bb->sleepTicksC = -1;
+}
+
+TEST_CASE("Pdfsm/8", "[Ticker]")
+{
+	using namespace std::chrono_literals;
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	pool.New();
+
+	SECTION("Variable timestep")
+	{
+		Pdfsm::Ticker<Pdfsm::ManualClock> ticker;
+		ticker.GetClock().Advance(7ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 1);
+		REQUIRE(ctx.seq == 1);
+		REQUIRE(ctx.delta == 7ms);
+		REQUIRE(bb->updateCounterA == 1);
+		ticker.GetClock().Advance(3ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 1);
+		REQUIRE(ctx.seq == 2);
+		REQUIRE(ctx.delta == 3ms);
+		REQUIRE(bb->updateCounterA == 2);
+	}
+
+	SECTION("Fixed timestep")
+	{
+		Pdfsm::Ticker<Pdfsm::ManualClock> ticker;
+		ticker.SetFixedStep(10ms, 3);
+		ticker.GetClock().Advance(25ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 2);
+		REQUIRE(ctx.seq == 2);
+		REQUIRE(ctx.delta == 10ms);
+		// 5ms left in the accumulator.
+		ticker.GetClock().Advance(4ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 0);
+		ticker.GetClock().Advance(1ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 1);
+		REQUIRE(bb->updateCounterA == 3);
+		// Catch-up cap: runs 3 steps, drops the rest.
+		ticker.GetClock().Advance(57ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 3);
+		REQUIRE(ticker.Dropped() == 20ms);
+		ticker.GetClock().Advance(3ms);
+		REQUIRE(ticker.Tick(ctx, h, pool) == 1);
+		REQUIRE(ctx.seq == 7);
+		REQUIRE(bb->updateCounterA == 7);
+	}
+}
+
+TEST_CASE("Pdfsm/9", "[Signal routing]")
+{
+	signalBoard.Clear();
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	auto						  h1 = pool.New(), h2 = pool.New(), h3 = pool.New();
+	auto route = [&]() {
+		return signalRouter.Route(h, pool, ctx, signalBoard.Fired(),
+			[](const auto& signature, auto&& cb) { signalBoard.Poll(signature, cb); });
+	};
+	// all inits to A
+	h.Update(pool, ctx);
+	REQUIRE(pool.Members(S::A).size() == 3);
+	// h2 jumps to B.
+	h.SetHandlingFsm(pool, h2, ctx);
+	h.Jump(ctx, S::B);
+	h.ClearHandlingFsm();
+	REQUIRE(pool.Members(S::A).size() == 2);
+	REQUIRE(pool.Members(S::B).size() == 1);
+	// Nothing fired.
+	REQUIRE(route() == 0);
+	// Signal z only reaches machines in B, h1 and h3 are not visited.
+	pool.Sleep(h1);
+	signals.z->Emit(0);
+	signalBoard.Flip();
+	REQUIRE(route() == 1);
+	REQUIRE(pool[h2].stack[pool[h2].top] == static_cast<int>(S::C));
+	REQUIRE(pool.Members(S::C).size() == 1);
+	REQUIRE(pool.IsDormant(h1));
+	// Signal x reaches machines in A, and wakes up the dormant h1.
+	signals.x->Emit(0);
+	signalBoard.Flip();
+	REQUIRE(route() == 2);
+	REQUIRE(pool.Members(S::A).empty());
+	REQUIRE(pool.Members(S::B).size() == 2);
+	REQUIRE(!pool.IsDormant(h1));
+	REQUIRE(bb->onEnterCounterB == 3);
+	// No subscribers in A now.
+	signals.y->Emit(0);
+	signalBoard.Flip();
+	REQUIRE(route() == 0);
+	REQUIRE(bb->onEnterCounterC == 1);
+	// Freeing removes membership.
+	pool.Free(h3);
+	REQUIRE(pool.Members(S::B).size() == 1);
+	// Signals x and z fired together, h4 jumps from A to B on x, and isn't delivered z again,
+	// only h1 in B before routing jumps to C.
+	auto h4 = pool.New();
+	h.SetHandlingFsm(pool, h4, ctx);
+	h.ClearHandlingFsm();
+	signals.x->Emit(0);
+	signals.z->Emit(0);
+	signalBoard.Flip();
+	REQUIRE(route() == 2);
+	REQUIRE(pool[h4].stack[pool[h4].top] == static_cast<int>(S::B));
+	REQUIRE(pool[h1].stack[pool[h1].top] == static_cast<int>(S::C));
+	REQUIRE(bb->onEnterCounterC == 2);
+}
+
+TEST_CASE("Pdfsm/10", "[Signal buffer]")
+{
+	signalBoard.Clear();
+	auto connection = signalBoard.Connect({ "x", "z" });
+	struct Point
+	{
+		int x, y;
+	};
+	// Typed data are stored inline, others as std::any.
+	signals.z->Emit(Point{ 1, 2 });
+	signals.x->Emit(1);
+	signals.y->Emit(3);
+	signals.x->Emit(std::string("2"));
+	signalBoard.Flip();
+	std::vector<std::pair<Blinker::SignalId, std::string>> fired;
+	REQUIRE(connection->PollPayload([&](Blinker::SignalId id, const Blinker::Payload& data) {
+		if (id == signals.x->Id())
+			fired.emplace_back(id, data.IsInline() ? std::to_string(data.As<int>()) : std::any_cast<std::string>(data.ToAny()));
+		else
+			fired.emplace_back(id, std::to_string(data.As<Point>().y));
+	}) == 2);
+	// Ordered by signal id, and then emitting order.
+	REQUIRE(fired.size() == 3);
+	REQUIRE(fired[0] == std::make_pair(signals.x->Id(), std::string("1")));
+	REQUIRE(fired[1] == std::make_pair(signals.x->Id(), std::string("2")));
+	REQUIRE(fired[2] == std::make_pair(signals.z->Id(), std::string("2")));
+	// Inline data are boxed for std::any callbacks.
+	int sum = 0;
+	connection->Poll([&](Blinker::SignalId id, std::any data) {
+		if (id == signals.z->Id())
+			sum += std::any_cast<Point>(data).x;
+	});
+	REQUIRE(sum == 1);
+	// The buffer is reused.
+	signalBoard.Flip();
+	REQUIRE(signalBoard.Fired().none());
+	REQUIRE(connection->Poll([](Blinker::SignalId, std::any) {}) == 0);
+	signals.z->Emit(Point{ 3, 4 });
+	signalBoard.Flip();
+	REQUIRE(connection->PollPayload([&](Blinker::SignalId, const Blinker::Payload& data) {
+		REQUIRE(data.As<Point>().x == 3);
+	}) == 1);
+	signalBoard.Clear();
+}
+
+TEST_CASE("Pdfsm/11", "[Signal producers]")
+{
+	Blinker::Board<4> board;
+	auto			  x = board.NewSignal("x");
+	auto			  connection = board.Connect({ "x" });
+
+	const int nProducers = 4, nEvents = 10000;
+
+	struct Event
+	{
+		int i, j;
+	};
+
+	std::vector<Blinker::Producer<4>*> producers;
+	for (int i = 0; i < nProducers; i++)
+		producers.push_back(board.NewProducer(64));
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < nProducers; i++)
+		threads.emplace_back([&, i]() {
+			for (int j = 0; j < nEvents; j++)
+				while (!producers[i]->Emit(x->Id(), Event{ i, j }))
+					std::this_thread::yield();
+		});
+
+	// Events are merged in producers' order, and then emitting order.
+	std::vector<int> next(nProducers, 0);
+	int				 received = 0, lastProducer = -1;
+	bool			 ordered = true;
+	while (received < nProducers * nEvents)
+	{
+		board.Flip();
+		lastProducer = -1;
+		connection->PollPayload([&](Blinker::SignalId, const Blinker::Payload& data) {
+			auto [i, j] = data.As<Event>();
+			ordered = ordered && i >= lastProducer && j == next[i];
+			lastProducer = i, next[i] = j + 1, ++received;
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	REQUIRE(ordered);
+	REQUIRE(received == nProducers * nEvents);
+	board.Flip();
+	REQUIRE(board.Fired().none());
+}
+
+TEST_CASE("Pdfsm/12", "[Signal batched matching]")
+{
+	Blinker::Board<128> board;
+	std::vector<std::shared_ptr<Blinker::Signal>> signals;
+	for (int i = 0; i < 100; i++)
+		signals.push_back(board.NewSignal("s." + std::to_string(i)));
+
+	Blinker::SignatureSet<128> set;
+	set.Add(*board.Connect({ "s.*" }));
+	set.Add(*board.Connect({ "s.3", "s.70" }));
+	set.Add(*board.Connect({ "s.5" }));
+	set.Add(*board.Connect({ "s.99" }));
+	REQUIRE(set.Size() == 4);
+
+	std::vector<Blinker::Hit> hits;
+	REQUIRE(board.MatchAll(set, hits) == 0);
+	REQUIRE(hits.empty());
+
+	signals[70]->Emit(1);
+	signals[3]->Emit(1);
+	signals[99]->Emit(1);
+	board.Flip();
+	REQUIRE(board.MatchAll(set, hits) == 3);
+	auto id = [&](int i) { return signals[i]->Id(); };
+	REQUIRE(hits.size() == 6);
+	REQUIRE((hits[0].connection == 0 && hits[0].id == id(3)));
+	REQUIRE((hits[1].connection == 0 && hits[1].id == id(70)));
+	REQUIRE((hits[2].connection == 0 && hits[2].id == id(99)));
+	REQUIRE((hits[3].connection == 1 && hits[3].id == id(3)));
+	REQUIRE((hits[4].connection == 1 && hits[4].id == id(70)));
+	REQUIRE((hits[5].connection == 3 && hits[5].id == id(99)));
+
+	board.Flip();
+	REQUIRE(board.MatchAll(set, hits) == 0);
+}
+
+TEST_CASE("Pdfsm/13", "[Inbox]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	Pdfsm::EventPool			  events(64);
+	pool.EnableInbox(events, 8);
+	auto h1 = pool.New(), h2 = pool.New();
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterA == 2);
+
+	// Posting wakes up a dormant machine, events are passed before updating.
+	pool.Sleep(h1);
+	REQUIRE(pool.Post(h1, { 7, std::string("hello") }));
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterA == 4);
+	REQUIRE(bb->events.size() == 1);
+	REQUIRE(bb->events[0].id == 7);
+	REQUIRE(std::any_cast<std::string>(bb->events[0].data) == "hello");
+
+	// The event pool is exhausted.
+	{
+		Pdfsm::EventPool		   few(2);
+		Pdfsm::StateMachinePool<S> p;
+		p.EnableInbox(few, 1);
+		auto x = p.New();
+		REQUIRE(p.Post(x, { 1 }));
+		REQUIRE(p.Post(x, { 2 }));
+		REQUIRE(!p.Post(x, { 3 }));
+		// Nodes are released on draining.
+		h.Update(p, ctx);
+		REQUIRE(p.Post(x, { 3 }));
+		// The pool can't grow beyond the inboxes, but handles are reused.
+		REQUIRE_THROWS_AS(p.New(), std::runtime_error);
+		p.Free(x);
+		REQUIRE(p.New() == x);
+		p.Free(x);
+	}
+
+	// Posting from multiple threads.
+	bb->events.clear();
+	pool.Sleep(h1), pool.Sleep(h2);
+	const int				 nThreads = 4, nEvents = 1000;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < nThreads; i++)
+		threads.emplace_back([&, i]() {
+			for (int j = 0; j < nEvents; j++)
+				while (!pool.Post(h2, { static_cast<unsigned int>(i), j }))
+					std::this_thread::yield();
+		});
+	while (bb->events.size() < nThreads * nEvents)
+	{
+		h.Update(pool, ctx);
+		pool.Sleep(h2);
+	}
+	for (auto& t : threads)
+		t.join();
+	REQUIRE(pool.IsDormant(h1));
+	// Per-thread order is kept.
+	std::vector<int> next(nThreads, 0);
+	bool			 ordered = true;
+	for (const auto& e : bb->events)
+		ordered = ordered && std::any_cast<int>(e.data) == next[e.id]++;
+	REQUIRE(ordered);
+}
+
+TEST_CASE("Pdfsm/14", "[Event queue]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	Pdfsm::EventPool			  events(256);
+	pool.EnableInbox(events, 4);
+	pool.EnableQueue(4, 2);
+	enum : unsigned int
+	{
+		Urgent = 1,
+		Position,
+		Damage,
+		Hello,
+		Plain,
+	};
+	pool.SetEventPolicy(Urgent, { 0 });
+	pool.SetEventPolicy(Position, { 1, Pdfsm::Coalescing::Replace });
+	pool.SetEventPolicy(Damage, { 1, Pdfsm::Coalescing::Accumulate, [](Pdfsm::Event& queued, const Pdfsm::Event& incoming) {
+									 queued.data = std::any_cast<int>(queued.data) + std::any_cast<int>(incoming.data);
+								 } });
+	pool.SetEventPolicy(Hello, { 1, Pdfsm::Coalescing::DropDuplicate });
+	pool.SetEventPolicy(Plain, { 1 });
+
+	auto x = pool.New();
+	h.Update(pool, ctx);
+	pool.Sleep(x);
+
+	for (int i = 0; i < 200; i++)
+		REQUIRE(pool.Enqueue(x, { Position, i }));
+	REQUIRE(pool.Enqueue(x, { Damage, 3 }));
+	REQUIRE(pool.Enqueue(x, { Hello, 1 }));
+	REQUIRE(pool.Enqueue(x, { Damage, 4 }));
+	REQUIRE(pool.Enqueue(x, { Hello, 2 }));
+	REQUIRE(pool.Enqueue(x, { Urgent, 0 }));
+	REQUIRE(pool.Enqueue(x, { Plain, 0 }));
+	// The ring of priority 1 is full.
+	REQUIRE(!pool.Enqueue(x, { Plain, 1 }));
+	REQUIRE(pool.QueueSize(x) == 5);
+	// Enqueuing wakes up the machine.
+	REQUIRE(!pool.IsDormant(x));
+
+	h.Update(pool, ctx);
+	REQUIRE(pool.QueueSize(x) == 0);
+	REQUIRE(bb->events.size() == 5);
+	REQUIRE(bb->events[0].id == Urgent);
+	REQUIRE(bb->events[1].id == Position);
+	REQUIRE(std::any_cast<int>(bb->events[1].data) == 199);
+	REQUIRE(bb->events[2].id == Damage);
+	REQUIRE(std::any_cast<int>(bb->events[2].data) == 7);
+	REQUIRE(bb->events[3].id == Hello);
+	REQUIRE(std::any_cast<int>(bb->events[3].data) == 1);
+	REQUIRE(bb->events[4].id == Plain);
+
+	// Events posted to inbox are coalesced as well.
+	bb->events.clear();
+	for (int i = 0; i < 10; i++)
+		REQUIRE(pool.Post(x, { Position, i }));
+	h.Update(pool, ctx);
+	REQUIRE(bb->events.size() == 1);
+	REQUIRE(std::any_cast<int>(bb->events[0].data) == 9);
+}
+
+TEST_CASE("Pdfsm/15", "[Actor runtime]")
+{
+	auto					   bb = std::make_shared<JobBlackboard>();
+	Pdfsm::StateMachinePool<J> pool;
+	Pdfsm::EventPool		   events(1024);
+	const int				   nJobs = 1000, nThreads = 4, nProgress = 10;
+
+	Pdfsm::ActorRuntime<J> runtime(pool, events, nJobs + 2, 4, MakeJobHandler, Pdfsm::Context(bb));
+
+	std::vector<Pdfsm::Handle> jobs;
+	for (int i = 0; i < nJobs; i++)
+		jobs.push_back(runtime.Spawn());
+	REQUIRE(pool.Members(J::Pending).size() == nJobs);
+	REQUIRE(pool[jobs[0]].top == 0);
+	REQUIRE(pool.NumActive() == 0); // scheduled by events only
+
+	auto post = [&](Pdfsm::Handle x, unsigned int id) {
+		while (!runtime.Post(x, { id }))
+			std::this_thread::yield();
+	};
+
+	// Each thread drives a slice of jobs, the last job fails.
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nThreads; t++)
+		threads.emplace_back([&, t]() {
+			for (int i = t; i < nJobs; i += nThreads)
+			{
+				post(jobs[i], Start);
+				for (int j = 0; j < nProgress; j++)
+					post(jobs[i], Progress);
+				post(jobs[i], i == nJobs - 1 ? Fail : Finish);
+			}
+		});
+	for (auto& t : threads)
+		t.join();
+	runtime.WaitIdle();
+
+	REQUIRE(bb->started == nJobs);
+	REQUIRE(bb->progressed == nJobs * nProgress);
+	REQUIRE(bb->done == nJobs - 1);
+	REQUIRE(bb->failed == 1);
+	for (int i = 0; i < nJobs - 1; i++)
+		REQUIRE(pool[jobs[i]].stack[pool[jobs[i]].top] == static_cast<int>(J::Done));
+	REQUIRE(pool.Members(J::Pending).size() == 0);
+	REQUIRE(pool.Members(J::Done).size() == nJobs - 1);
+	REQUIRE(pool.Members(J::Failed).size() == 1);
+	REQUIRE(pool.NumActive() == 0);
+
+	// Locks are checked, the event rejected is dropped.
+	std::atomic<int> errors = 0;
+	runtime.SetErrorHandler([&](Pdfsm::Handle, std::exception_ptr) { errors++; });
+	pool.EnableLocks();
+	auto x = runtime.Spawn();
+	pool.SetLock(x, J::Running, true);
+	post(x, Start);
+	post(x, Fail);
+	runtime.WaitIdle();
+	REQUIRE(errors == 1);
+	REQUIRE(bb->started == nJobs);
+	REQUIRE(pool[x].stack[pool[x].top] == static_cast<int>(J::Failed));
+	REQUIRE(pool.Members(J::Failed).size() == 2);
+	// Posting to the pool goes through the runtime.
+	auto y = runtime.Spawn();
+	while (!pool.Post(y, { Start }))
+		std::this_thread::yield();
+	runtime.WaitIdle();
+	REQUIRE(pool[y].stack[pool[y].top] == static_cast<int>(J::Running));
+	REQUIRE(bb->started == nJobs + 1);
+	// Idle machines can be freed, but not ones having events pending.
+	runtime.Free(y);
+	REQUIRE(pool.Members(J::Running).empty());
+	REQUIRE(runtime.Spawn() == y);
+	runtime.Stop();
+	post(y, Start);
+	REQUIRE_THROWS_AS(runtime.Free(y), std::runtime_error);
+	REQUIRE(pool.Members(J::Pending).size() == 1);
+}
+
+#ifdef __linux__
+TEST_CASE("Pdfsm/16", "[Reactor]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	Pdfsm::Reactor<S>			  reactor(h, pool);
+	auto						  h1 = pool.New(), h2 = pool.New();
+	h.Update(pool, ctx);
+
+	int a[2], b[2];
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, a) == 0);
+	REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b) == 0);
+	reactor.Register(h1, a[0], EPOLLIN | EPOLLRDHUP);
+	reactor.Register(h2, b[0], EPOLLIN | EPOLLRDHUP);
+
+	// Nothing ready.
+	REQUIRE(reactor.Poll(ctx, 0) == 0);
+
+	// Only h1 is notified.
+	REQUIRE(write(a[1], "x", 1) == 1);
+	REQUIRE(reactor.Poll(ctx, 1000) == 1);
+	REQUIRE(bb->ready.size() == 1);
+	REQUIRE(std::get<0>(bb->ready[0]) == static_cast<int>(S::A));
+	REQUIRE(std::get<1>(bb->ready[0]) == a[0]);
+	REQUIRE(std::get<2>(bb->ready[0]) & EPOLLIN);
+
+	// Edge-triggered, not notified again until new data arrives.
+	REQUIRE(reactor.Poll(ctx, 0) == 0);
+
+	// Readiness goes to the current state.
+	h.SetHandlingFsm(pool, h2, ctx);
+	h.Jump(ctx, S::B);
+	h.ClearHandlingFsm();
+	REQUIRE(write(b[1], "y", 1) == 1);
+	REQUIRE(reactor.Poll(ctx, 1000) == 1);
+	REQUIRE(bb->ready.size() == 2);
+	REQUIRE(std::get<0>(bb->ready[1]) == static_cast<int>(S::B));
+	REQUIRE(std::get<1>(bb->ready[1]) == b[0]);
+
+	// Peer closed.
+	close(a[1]);
+	REQUIRE(reactor.Poll(ctx, 1000) == 1);
+	REQUIRE(std::get<2>(bb->ready[2]) & EPOLLRDHUP);
+
+	reactor.Unregister(a[0]);
+	reactor.Unregister(b[0]);
+	close(a[0]), close(b[0]), close(b[1]);
+}
+#endif
+
+// Minimal eager coroutine type for tests.
+struct Task
+{
+	struct promise_type
+	{
+		Task				get_return_object() { return {}; }
+		std::suspend_never	initial_suspend() noexcept { return {}; }
+		std::suspend_never	final_suspend() noexcept { return {}; }
+		void				return_void() {}
+		void				unhandled_exception() { std::terminate(); }
+	};
+};
+
+TEST_CASE("Pdfsm/17", "[WaitFor]")
+{
+	auto					   bb = std::make_shared<JobBlackboard>();
+	Pdfsm::StateMachinePool<J> pool;
+	Pdfsm::EventPool		   events(64);
+	pool.EnableWaitFor(8);
+
+	Pdfsm::ActorRuntime<J> runtime(pool, events, 8, 2, MakeJobHandler, Pdfsm::Context(bb));
+	auto				   j1 = runtime.Spawn(), j2 = runtime.Spawn();
+
+	// Reached already.
+	REQUIRE(pool.WaitFor(j1, J::Pending) == J::Pending);
+
+	// A coroutine awaits j2 to fail.
+	std::atomic<int> awaited = -1;
+	auto			 await = [&]() -> Task {
+		auto state = co_await pool.AsyncWaitFor(j2, J::Done, J::Failed);
+		awaited = static_cast<int>(state);
+	};
+	await();
+	REQUIRE(awaited == -1);
+
+	// A thread blocks until j1 finishes.
+	std::atomic<int> waited = -1;
+	std::thread		 waiter([&]() { waited = static_cast<int>(pool.WaitFor(j1, J::Done, J::Failed)); });
+
+	runtime.Post(j1, { Start });
+	runtime.Post(j1, { Progress });
+	runtime.Post(j2, { Start });
+	runtime.Post(j1, { Finish });
+	waiter.join();
+	REQUIRE(waited == static_cast<int>(J::Done));
+	REQUIRE(awaited == -1);
+
+	runtime.Post(j2, { Fail });
+	REQUIRE(pool.WaitFor(j2, J::Failed) == J::Failed);
+	runtime.WaitIdle();
+	REQUIRE(awaited == static_cast<int>(J::Failed));
+	runtime.Stop();
+
+	// Machines handled within a pool publish states as well.
+	Pdfsm::StateMachinePool<S> pool2;
+	pool2.EnableWaitFor(1);
+	auto						  bb2 = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb2);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	auto						  x = pool2.New();
+	h.SetHandlingFsm(pool2, x, ctx);
+	int	 onEnterB = -1;
+	auto await2 = [&]() -> Task {
+		co_await pool2.AsyncWaitFor(x, S::B);
+		onEnterB = bb2->onEnterCounterB;
+	};
+	await2();
+	REQUIRE(onEnterB == -1);
+	h.Jump(ctx, S::B);
+	REQUIRE(onEnterB == 1); // resumed right after OnEnter
+	h.ClearHandlingFsm();
+	// Freeing the machine fails its waiters.
+	bool failed = false;
+	auto await3 = [&]() -> Task {
+		try
+		{
+			co_await pool2.AsyncWaitFor(x, S::A);
+		}
+		catch (const std::runtime_error&)
+		{
+			failed = true;
+		}
+	};
+	await3();
+	std::atomic<bool> thrown = false;
+	auto			  wait = [&]() {
+		try
+		{
+			pool2.WaitFor(x, S::A);
+		}
+		catch (const std::runtime_error&)
+		{
+			thrown = true;
+		}
+	};
+	std::thread waiter2(wait);
+	pool2.Free(x);
+	waiter2.join();
+	REQUIRE(failed);
+	REQUIRE(thrown);
+	REQUIRE_THROWS_AS(pool2.WaitFor(x, S::A), std::runtime_error);
+	// Until the handle is reused.
+	REQUIRE(pool2.New() == x);
+	h.SetHandlingFsm(pool2, x, ctx);
+	REQUIRE(pool2.WaitFor(x, S::A) == S::A);
+	h.ClearHandlingFsm();
+	// The pool can't grow beyond the watches.
+	REQUIRE_THROWS_AS(pool2.New(), std::runtime_error);
+}
+
+TEST_CASE("Pdfsm/18", "[Script]")
+{
+	auto						  bb = std::make_shared<WalkBlackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<W> h(walkBehaviorTable, walkTransitionTable);
+	Pdfsm::StateMachinePool<W>	  pool;
+	pool.EnableScripts(512, 2);
+	auto x = pool.New(), y = pool.New();
+	ctx.delta = std::chrono::milliseconds(10);
+	h.Update(pool, ctx);
+
+	// Starts on enter, runs until the first co_await.
+	h.SetHandlingFsm(pool, x, ctx);
+	h.Jump(ctx, W::Walk);
+	h.ClearHandlingFsm();
+	REQUIRE(bb->trace == std::vector<int>{ 1 });
+	REQUIRE(pool.NumScripts() == 1);
+	// Next tick.
+	h.Update(pool, ctx);
+	REQUIRE(bb->trace == std::vector<int>{ 1, 2 });
+	// Delay 20ms, by 10ms ticks.
+	h.Update(pool, ctx);
+	REQUIRE(bb->trace.size() == 2);
+	h.Update(pool, ctx);
+	REQUIRE(bb->trace == std::vector<int>{ 1, 2, 3 });
+	// Waits for the event.
+	h.Update(pool, ctx);
+	h.SetHandlingFsm(pool, x, ctx);
+	h.Dispatch(ctx, { 2 }); // not this one
+	REQUIRE(bb->arrivedAt == -1);
+	h.Dispatch(ctx, { Arrive, 7 });
+	REQUIRE(bb->arrivedAt == 7);
+	h.ClearHandlingFsm();
+	// Jumps out from the script, the frame is released.
+	h.Update(pool, ctx);
+	REQUIRE(pool[x].stack[pool[x].top] == static_cast<int>(W::Done));
+	REQUIRE(pool.NumScripts() == 0);
+
+	// Terminated by others, or freed, in the middle of the script.
+	h.SetHandlingFsm(pool, y, ctx);
+	h.Jump(ctx, W::Walk);
+	REQUIRE(pool.NumScripts() == 1);
+	h.Jump(ctx, W::Idle);
+	REQUIRE(pool.NumScripts() == 0);
+	h.Jump(ctx, W::Walk);
+	h.ClearHandlingFsm();
+	REQUIRE(pool.NumScripts() == 1);
+	pool.Free(y);
+	REQUIRE(pool.NumScripts() == 0);
+
+	// Run by an ActorRuntime, scripts start and end on worker threads, resumed by events.
+	Pdfsm::StateMachinePool<W> pool2;
+	Pdfsm::EventPool		   events(64);
+	const int				   nWalkers = 16;
+	pool2.EnableScripts(512, nWalkers);
+	Pdfsm::ActorRuntime<W>	   runtime(pool2, events, nWalkers, 4, MakeWalkHandler, ctx);
+	std::vector<Pdfsm::Handle> walkers;
+	for (int i = 0; i < nWalkers; i++)
+		walkers.push_back(runtime.Spawn());
+	for (auto w : walkers)
+		runtime.Post(w, { Depart });
+	runtime.WaitIdle();
+	REQUIRE(pool2.NumScripts() == nWalkers);
+	REQUIRE(pool2.Members(W::Walk).size() == nWalkers);
+	for (auto w : walkers)
+		runtime.Post(w, { Arrive });
+	runtime.WaitIdle();
+	REQUIRE(bb->arrived == nWalkers);
+	REQUIRE(pool2.NumScripts() == 0);
+	REQUIRE(pool2.Members(W::Done).size() == nWalkers);
+	runtime.Stop();
+}
+
+TEST_CASE("Pdfsm/19", "[Asynchronous transition]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachine<S>		  fsm;
+	h.SetHandlingFsm(fsm, ctx);
+	bb->exitingTicksA = 2, bb->enteringTicksB = 4;
+
+	// Starts the Exiting phase.
+	h.JumpAsync(ctx, S::B);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::Exiting);
+	REQUIRE(h.Top() == S::A);
+	REQUIRE_THROWS_AS(h.JumpAsync(ctx, S::A), std::runtime_error);
+	h.Update(ctx);
+	REQUIRE(h.Progress() == 0.5f);
+	REQUIRE(h.Top() == S::A);
+	// Exited, then jumps and enters.
+	h.Update(ctx);
+	REQUIRE(bb->onTerminateCounterA == 1);
+	REQUIRE(bb->onEnterCounterB == 1);
+	REQUIRE(h.Top() == S::B);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::Entering);
+	REQUIRE(h.Progress() == 0.25f);
+	h.Update(ctx);
+	h.Update(ctx);
+	REQUIRE(h.Progress() == 0.75f);
+	h.Update(ctx);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::None);
+	// Neither state updated meanwhile.
+	REQUIRE(bb->updateCounterA == 0);
+	REQUIRE(bb->updateCounterB == 0);
+	h.Update(ctx);
+	REQUIRE(bb->updateCounterB == 1);
+
+	// A synchronous transition cancels it, unless it's rejected.
+	h.JumpAsync(ctx, S::C);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::Exiting);
+	REQUIRE_THROWS_AS(h.Jump(ctx, S::A), std::runtime_error);
+	REQUIRE_THROWS_AS(h.Push(ctx, S::A), std::runtime_error);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::Exiting);
+	h.Jump(ctx, S::C);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::None);
+	h.Update(ctx);
+	REQUIRE(bb->updateCounterC == 1);
+
+	// A transition made by OnEnter of the target takes over.
+	Pdfsm::StateMachine<S> fsm2;
+	h.SetHandlingFsm(fsm2, ctx);
+	bb->exitingTicksA = 1, bb->jumpOnEnterB = true;
+	h.JumpAsync(ctx, S::B);
+	h.Update(ctx);
+	REQUIRE(h.Top() == S::C);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::None);
+	bb->jumpOnEnterB = false;
+
+	// A target locked meanwhile cancels it.
+	Pdfsm::StateMachinePool<S> pool;
+	pool.EnableLocks();
+	auto x = pool.New();
+	h.SetHandlingFsm(pool, x, ctx);
+	h.JumpAsync(ctx, S::B);
+	pool.SetLock(x, S::B, true);
+	REQUIRE_THROWS_AS(h.Update(ctx), std::runtime_error);
+	REQUIRE(h.CurrentPhase() == Pdfsm::Phase::None);
+	REQUIRE(h.Top() == S::A);
+	h.Update(ctx);
+	h.ClearHandlingFsm();
+}
+
+TEST_CASE("Pdfsm/20", "[Hierarchy]")
+{
+	static_assert(hierarchy.Depth(static_cast<int>(H::Melee)) == 1);
+	static_assert(hierarchy.Scope(static_cast<int>(H::Melee), static_cast<int>(H::Ranged)) == static_cast<int>(H::Combat));
+	static_assert(hierarchy.Scope(static_cast<int>(H::Melee), static_cast<int>(H::Idle)) == -1);
+
+	auto						  bb = std::make_shared<HierarchyBlackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<H> h(hierarchyBehaviorTable, hierarchyTransitionTable);
+	h.SetHierarchy(hierarchy);
+	Pdfsm::StateMachine<H> fsm;
+	h.SetHandlingFsm(fsm, ctx);
+	using Trace = std::vector<std::string>;
+
+	// Enters the path below the common ancestor.
+	bb->trace.clear();
+	h.Jump(ctx, H::Melee);
+	REQUIRE(bb->trace == Trace{ "terminate Idle", "enter Combat", "enter Melee" });
+	// Bubbles from the leaf to the root.
+	bb->trace.clear();
+	h.Update(ctx);
+	REQUIRE(bb->trace == Trace{ "update Melee", "update Combat" });
+	// Siblings, the parent stays.
+	bb->trace.clear();
+	h.Jump(ctx, H::Ranged);
+	REQUIRE(bb->trace == Trace{ "terminate Melee", "enter Ranged" });
+	// Inherited transition, made by the parent's BeforeUpdate.
+	REQUIRE_THROWS_AS(h.Jump(ctx, H::Idle), std::runtime_error);
+	bb->stunned = true;
+	bb->trace.clear();
+	h.Update(ctx);
+	REQUIRE(bb->trace == Trace{ "terminate Ranged", "terminate Combat", "enter Stunned" });
+	REQUIRE(h.Top() == H::Stunned);
+	// Push and pop the path.
+	h.Jump(ctx, H::Idle);
+	bb->trace.clear();
+	h.Push(ctx, H::Melee);
+	h.Pop(ctx);
+	REQUIRE(bb->trace == Trace{ "enter Combat", "enter Melee", "terminate Melee", "terminate Combat" });
+
+	// Another hierarchy replaces the inherited transitions.
+	static constexpr Pdfsm::Hierarchy<H> meleeOnly = {
+		{ H::Melee, H::Combat },
+	};
+	REQUIRE(h.IsValid(H::Ranged, H::Stunned));
+	h.SetHierarchy(meleeOnly);
+	REQUIRE_FALSE(h.IsValid(H::Ranged, H::Stunned));
+	REQUIRE(h.IsValid(H::Melee, H::Stunned));
+	REQUIRE(h.IsValid(H::Melee, H::Ranged));
+	h.SetHierarchy(hierarchy);
+	REQUIRE(h.IsValid(H::Ranged, H::Stunned));
+	REQUIRE(h.Distance(H::Ranged, H::Idle) == 2);
+
+	// Wildcard rules from a group admit the substates of the group.
+	Pdfsm::StateMachineHandler<H> h2(hierarchyBehaviorTable, hierarchyTransitionTable, { { { H::Idle }, {}, { H::Combat } } });
+	REQUIRE_FALSE(h2.IsValid(H::Melee, H::Idle));
+	h2.SetHierarchy(meleeOnly);
+	REQUIRE(h2.IsValid(H::Melee, H::Idle));
+	REQUIRE_FALSE(h2.IsValid(H::Ranged, H::Idle));
+	h2.SetHierarchy(hierarchy);
+	REQUIRE(h2.IsValid(H::Ranged, H::Idle));
+	REQUIRE(h2.Distance(H::Ranged, H::Idle) == 1);
+}
+
+TEST_CASE("Pdfsm/21", "[Regions]")
+{
+	using Fsm = Pdfsm::RegionalStateMachine<Npc, Npc::Idle, Npc::Neutral>;
+	static_assert(sizeof(Fsm) == sizeof(int) * (static_cast<int>(Npc::N) + 2));
+
+	auto							bb = std::make_shared<NpcBlackboard>();
+	auto							ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<Npc> h(npcBehaviorTable, npcTransitionTable);
+
+	std::vector<Fsm> npcs(3);
+	// One pass updates all regions of each machine.
+	for (auto& npc : npcs)
+	{
+		h.SetHandlingFsm(npc, ctx);
+		h.Update(ctx);
+	}
+	REQUIRE(bb->updateCounterIdle == 3);
+	REQUIRE(bb->updateCounterNeutral == 3);
+
+	// Regions transit independently, the emote region is made happy by the locomotion's hook,
+	// and it's updated later in the same pass.
+	h.SetHandlingFsm(npcs[0], ctx);
+	bb->walk = true;
+	h.Update(ctx);
+	REQUIRE(bb->updateCounterHappy == 1);
+	REQUIRE(bb->updateCounterNeutral == 3);
+	h.Focus(Npc::Idle);
+	REQUIRE(h.Top() == Npc::Walk);
+	REQUIRE_THROWS_AS(h.Jump(ctx, Npc::Idle), std::runtime_error);
+	REQUIRE_THROWS_AS(h.JumpAsync(ctx, Npc::Walk), std::runtime_error);
+	// Pushes and pops within the current region.
+	h.Focus(Npc::Happy);
+	REQUIRE(h.Top() == Npc::Happy);
+	h.Push(ctx, Npc::Neutral);
+	REQUIRE(h.Top() == Npc::Neutral);
+	h.Pop(ctx);
+	REQUIRE(h.Top() == Npc::Happy);
+	h.ClearHandlingFsm();
+
+	// Stacks are adjacent, each sized to its region.
+	REQUIRE(npcs[0].top[0] == 0);
+	REQUIRE(npcs[0].stack[0] == static_cast<int>(Npc::Walk));
+	REQUIRE(npcs[0].top[1] == 0);
+	REQUIRE(npcs[0].stack[2] == static_cast<int>(Npc::Happy));
+	REQUIRE(npcs[1].stack[2] == static_cast<int>(Npc::Neutral));
+}
+
+TEST_CASE("Pdfsm/22", "[Nested machines]")
+{
+	using Npc = Pdfsm::NestedStateMachine<P, CombatState>;
+
+	auto						  bb = std::make_shared<NestedBlackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<P> h(nestedBehaviorTable, nestedTransitionTable);
+	std::vector<Npc>			  npcs(2);
+
+	// Entering combat starts the child machine.
+	for (auto& npc : npcs)
+	{
+		h.SetHandlingFsm(npc, ctx);
+		h.Jump(ctx, P::Combat);
+		REQUIRE(npc.Child<CombatState>().top == 0);
+	}
+	// Updates go through both levels.
+	bb->inRange = true;
+	h.SetHandlingFsm(npcs[0], ctx);
+	h.Update(ctx);
+	REQUIRE(bb->updateCounterApproach == 1);
+	REQUIRE(npcs[0].Child<CombatState>().stack[npcs[0].Child<CombatState>().top] == static_cast<int>(CombatState::Attack));
+	REQUIRE(npcs[1].Child<CombatState>().stack[npcs[1].Child<CombatState>().top] == static_cast<int>(CombatState::Approach));
+	h.Update(ctx);
+	REQUIRE(bb->updateCounterAttack == 1);
+	// Events, pausing and resuming are forwarded.
+	h.Dispatch(ctx, { 42 });
+	REQUIRE(bb->events == std::vector<unsigned int>{ 42 });
+	h.Push(ctx, P::Idle);
+	REQUIRE(bb->onPauseCounterAttack == 1);
+	h.Pop(ctx);
+	REQUIRE(bb->onResumeCounterAttack == 1);
+	// Leaving combat terminates the child machine.
+	h.Jump(ctx, P::Idle);
+	REQUIRE(bb->onTerminateCounterAttack == 1);
+	REQUIRE(npcs[0].Child<CombatState>().top == -1);
+	h.ClearHandlingFsm();
+
+	// Batched updates go through both levels, the child machines are stored in the pool.
+	Pdfsm::StateMachinePool<P> pool;
+	pool.EnableChildren<CombatState>();
+	auto x = pool.New(), y = pool.New();
+	h.Update(pool, ctx);
+	h.SetHandlingFsm(pool, x, ctx);
+	h.Jump(ctx, P::Combat);
+	h.ClearHandlingFsm();
+	REQUIRE(pool.Child<CombatState>(x).top == 0);
+	REQUIRE(pool.Child<CombatState>(y).top == -1);
+	bb->inRange = false;
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterApproach == 2);
+	bb->inRange = true;
+	h.Update(pool, ctx);
+	h.Update(pool, ctx);
+	REQUIRE(bb->updateCounterApproach == 3);
+	REQUIRE(bb->updateCounterAttack == 2);
+	REQUIRE(pool.Child<CombatState>(x).stack[pool.Child<CombatState>(x).top] == static_cast<int>(CombatState::Attack));
+	// Leaving combat terminates the child machine, and a reused handle gets a new one.
+	h.SetHandlingFsm(pool, x, ctx);
+	h.Jump(ctx, P::Idle);
+	REQUIRE(bb->onTerminateCounterAttack == 2);
+	h.Jump(ctx, P::Combat);
+	h.ClearHandlingFsm();
+	pool.Free(x);
+	REQUIRE(pool.New() == x);
+	REQUIRE(pool.Child<CombatState>(x).top == -1);
+
+	// Flat machines and pools without the child machines can't hold them.
+	Pdfsm::StateMachine<P>	   flat;
+	Pdfsm::StateMachinePool<P> pool2;
+	REQUIRE_THROWS_AS(h.SetHandlingFsm(flat, ctx), std::runtime_error);
+	REQUIRE_THROWS_AS(h.SetHandlingFsm(pool2, pool2.New(), ctx), std::runtime_error);
+	REQUIRE(flat.top == -1);
+}
+
+TEST_CASE("Pdfsm/23", "[State data]")
+{
+	auto													 bb = std::make_shared<DataBlackboard>();
+	auto													 ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<D>							 h(dataBehaviorTable, dataTransitionTable);
+	Pdfsm::DataStateMachine<D, Pdfsm::MaxSizeOf<PatrolData>> fsm;
+	h.SetHandlingFsm(fsm, ctx);
+	auto token = std::make_shared<int>(0);
+
+	// Constructed from the entry data.
+	h.Jump(ctx, D::Patrol, PatrolData{ 3, 0, token });
+	REQUIRE(bb->waypoint == 3);
+	REQUIRE(token.use_count() == 2);
+	h.Update(ctx);
+	h.Update(ctx);
+	REQUIRE(bb->ticks == 2);
+	// Destroyed on termination.
+	h.Jump(ctx, D::Idle);
+	REQUIRE(token.use_count() == 1);
+	// Lvalues are copied.
+	PatrolData data{ 5, 0, token };
+	h.Push(ctx, D::Patrol, data);
+	REQUIRE(bb->waypoint == 5);
+	REQUIRE(token.use_count() == 3);
+	h.Update(ctx);
+	REQUIRE(bb->ticks == 1); // a new one
+	h.Pop(ctx);
+	REQUIRE(token.use_count() == 2);
+	// Constructed by default, or invalid entry data.
+	h.Jump(ctx, D::Patrol);
+	REQUIRE(bb->waypoint == 0);
+	h.Jump(ctx, D::Idle);
+	REQUIRE_THROWS_AS(h.Jump(ctx, D::Patrol, 42), std::runtime_error);
+	REQUIRE(h.Top() == D::Idle);
+	// Entering without data throws before the transition if it can't be constructed by default,
+	// so nothing is left to destroy.
+	auto destroyed = escortDestroyed;
+	REQUIRE_THROWS_AS(h.Jump(ctx, D::Escort), std::runtime_error);
+	REQUIRE_THROWS_AS(h.Push(ctx, D::Escort), std::runtime_error);
+	REQUIRE_THROWS_AS(h.JumpPath(ctx, D::Escort), std::runtime_error);
+	REQUIRE(h.Top() == D::Idle);
+	h.Jump(ctx, D::Patrol);
+	h.Jump(ctx, D::Idle);
+	REQUIRE(escortDestroyed == destroyed);
+	EscortData escort(7);
+	h.Jump(ctx, D::Escort, escort);
+	h.Jump(ctx, D::Idle);
+	REQUIRE(escortDestroyed == destroyed + 1);
+	h.ClearHandlingFsm();
+	// States with data can't be hierarchical.
+	static constexpr Pdfsm::Hierarchy<D> escorting = { { D::Escort, D::Patrol } };
+	REQUIRE_THROWS_AS(h.SetHierarchy(escorting), std::runtime_error);
+
+	// Machines without frames large enough can't hold the data.
+	Pdfsm::StateMachine<D>		 flat;
+	Pdfsm::DataStateMachine<D, 8> small;
+	Pdfsm::StateMachinePool<D>	 pool;
+	REQUIRE_THROWS_AS(h.SetHandlingFsm(flat, ctx), std::runtime_error);
+	REQUIRE_THROWS_AS(h.SetHandlingFsm(small, ctx), std::runtime_error);
+	REQUIRE_THROWS_AS(h.SetHandlingFsm(pool, pool.New(), ctx), std::runtime_error);
+	REQUIRE(flat.top == -1);
+	REQUIRE(small.top == -1);
+}
+
+TEST_CASE("Pdfsm/24", "[Wildcard transitions]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, Pdfsm::TransitionTable<S>{},
+		{
+			{ { S::C } },				 // from any
+			{ { S::B }, { S::C } },		 // from any except C
+			{ { S::A }, {}, { S::B } }, // from group { B }
+		});
+	Pdfsm::StateMachine<S> fsm;
+	h.SetHandlingFsm(fsm, ctx);
+
+	h.Jump(ctx, S::B);
+	h.Jump(ctx, S::A); // from B
+	h.Jump(ctx, S::C);
+	REQUIRE_THROWS_AS(h.Jump(ctx, S::B), std::runtime_error); // from C is excluded
+	REQUIRE_THROWS_AS(h.Jump(ctx, S::A), std::runtime_error); // C is not in the group
+	h.Jump(ctx, S::C);										   // from any, even itself
+	REQUIRE(h.Top() == S::C);
+
+	// Rules of a shared target admit the union of their states.
+	Pdfsm::StateMachineHandler<S> h2(behaviorTable, Pdfsm::TransitionTable<S>{},
+		{
+			{ { S::A }, {}, { S::B } },
+			{ { S::A, S::B }, {}, { S::C } },
+		});
+	REQUIRE(h2.IsValid(S::B, S::A));
+	REQUIRE(h2.IsValid(S::C, S::A));
+	REQUIRE(h2.IsValid(S::C, S::B));
+	REQUIRE_FALSE(h2.IsValid(S::A, S::A));
+	REQUIRE_FALSE(h2.IsValid(S::B, S::B));
+	REQUIRE(h2.Targets(S::C) == std::bitset<3>("011"));
+}
+
+TEST_CASE("Pdfsm/25", "[Locks]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	auto						  h1 = pool.New(), h2 = pool.New();
+	pool.EnableLocks();
+	auto h3 = pool.New();
+	h.Update(pool, ctx);
+
+	// Locks a single machine.
+	pool.SetLock(h1, S::B, true);
+	h.SetHandlingFsm(pool, h1, ctx);
+	REQUIRE_THROWS_AS(h.Jump(ctx, S::B), std::runtime_error);
+	REQUIRE(h.Top() == S::A);
+	pool.SetLock(h1, S::B, false);
+	h.Jump(ctx, S::B);
+	REQUIRE(h.Top() == S::B);
+
+	// Locks a team, then the whole pool.
+	pool.SetLock({ h2, h3 }, S::C, true);
+	REQUIRE(pool.IsLocked(h2, S::C));
+	REQUIRE(!pool.IsLocked(h1, S::C));
+	h.SetHandlingFsm(pool, h2, ctx);
+	REQUIRE_THROWS_AS(h.Push(ctx, S::C), std::runtime_error);
+	pool.SetLock(S::C, true);
+	h.SetHandlingFsm(pool, h1, ctx);
+	REQUIRE_THROWS_AS(h.Jump(ctx, S::C), std::runtime_error);
+	pool.SetLock(S::C, false);
+	h.Jump(ctx, S::C);
+	REQUIRE(h.Top() == S::C);
+	h.ClearHandlingFsm();
+
+	// Locks are cleared on reuse, and new machines are not locked by the whole pool's lock.
+	pool.SetLock(S::B, true);
+	pool.Free(h3);
+	REQUIRE(!pool.IsLocked(pool.New(), S::B));
+	std::vector<Pdfsm::Handle> more;
+	for (int i = 0; i < 100; ++i)
+		more.push_back(pool.New());
+	REQUIRE(!pool.IsLocked(more.back(), S::B));
+	REQUIRE(pool.IsLocked(h1, S::B));
+}
+
+TEST_CASE("Pdfsm/26", "[Guards]")
+{
+	Pdfsm::TransitionTable<S> guarded = {
+		{ S::A, { S::B }, "speed > 0.1 && !stunned" },
+		{ S::A, { S::C }, "hp <= 0" },
+		{ S::B, { S::C }, "-speed >= 2 || (hp + 1) * 2 == 4" },
+	};
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, guarded);
+	Pdfsm::GuardProgram<S>		  program(guarded, { "speed", "stunned", "hp" });
+	Pdfsm::StateMachinePool<S>	  pool;
+	pool.EnableFields(3);
+	pool.EnableLocks();
+	std::vector<Pdfsm::Handle> handles;
+	for (int i = 0; i < 100; ++i)
+		handles.push_back(pool.New());
+	h.Update(pool, ctx);
+	REQUIRE(program.Field("hp") == 2);
+	REQUIRE(program.Field("mana") == -1);
+
+	// Nothing holds, all hp are 0 but the first 50.
+	for (int i = 0; i < 50; ++i)
+		pool.Field(2, handles[i]) = 10;
+	REQUIRE(program.Fire(h, pool, ctx) == 50);
+	REQUIRE(pool.Members(S::C).size() == 50);
+	REQUIRE(program.Fire(h, pool, ctx) == 0);
+
+	// Moving machines, but the stunned ones, jump to B.
+	for (int i = 0; i < 50; ++i)
+		pool.Field(0, handles[i]) = i < 40 ? 1.f : 0.f, pool.Field(1, handles[i]) = i < 10;
+	REQUIRE(program.Fire(h, pool, ctx) == 30);
+	REQUIRE(pool.Members(S::B).size() == 30);
+	REQUIRE(pool.Members(S::A).size() == 20);
+
+	// From B, by arithmetic.
+	pool.Field(0, handles[10]) = -3;
+	pool.Field(2, handles[11]) = 1;
+	pool.SetLock(handles[12], S::C, true);
+	pool.Field(2, handles[12]) = 1;
+	REQUIRE(program.Fire(h, pool, ctx) == 2);
+	REQUIRE(pool.Members(S::B).size() == 28);
+	// Guards only gate firing, the transitions are valid by the table.
+	REQUIRE(h.IsValid(S::A, S::C));
+
+	// Invalid guards.
+	Pdfsm::TransitionTable<S> invalid1 = { { S::A, { S::B }, "speed >" } };
+	Pdfsm::TransitionTable<S> invalid2 = { { S::A, { S::B }, "mana > 1" } };
+	Pdfsm::TransitionTable<S> invalid3 = { { S::A, { S::B, S::C }, "speed > 1" } };
+	REQUIRE_THROWS_AS(Pdfsm::GuardProgram<S>(invalid1, { "speed" }), std::runtime_error);
+	REQUIRE_THROWS_AS(Pdfsm::GuardProgram<S>(invalid2, { "speed" }), std::runtime_error);
+	REQUIRE_THROWS_AS(Pdfsm::GuardProgram<S>(invalid3, { "speed" }), std::runtime_error);
+	// The pool has fewer fields than declared.
+	Pdfsm::StateMachinePool<S> few;
+	few.EnableFields(2);
+	REQUIRE_THROWS_AS(program.Fire(h, few, ctx), std::runtime_error);
+}
+
+TEST_CASE("Pdfsm/27", "[Rules]")
+{
+	enum Field
+	{
+		Health,
+		Distance
+	};
+	std::initializer_list<Pdfsm::ThresholdRule<S>> thresholds = {
+		{ S::A, Health, Pdfsm::Comparator::Lt, 20, S::C },
+		{ S::A, Distance, Pdfsm::Comparator::Le, 5, S::B },
+		{ S::B, Health, Pdfsm::Comparator::Lt, 20, S::C },
+	};
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::RuleEngine<S>		  rules(h, thresholds);
+	Pdfsm::StateMachinePool<S>	  pool;
+	pool.EnableFields(2);
+	pool.EnableLocks();
+	std::vector<Pdfsm::Handle> handles;
+	for (int i = 0; i < 10; ++i)
+		handles.push_back(pool.New()), pool.Field(Health, handles[i]) = 100, pool.Field(Distance, handles[i]) = 10;
+	h.Update(pool, ctx);
+	REQUIRE(rules.Evaluate(pool).empty());
+
+	// The first matching rule wins.
+	pool.Field(Health, handles[0]) = 10, pool.Field(Distance, handles[0]) = 1;
+	pool.Field(Distance, handles[1]) = 5;
+	pool.Field(Health, handles[2]) = 10;
+	pool.Field(Distance, handles[3]) = 1;
+	pool.SetLock(handles[3], S::B, true);
+	pool.Field(Distance, handles[4]) = 1;
+	pool.Sleep(handles[4]);
+	const auto& batch = rules.Evaluate(pool);
+	REQUIRE(batch.size() == 3);
+	REQUIRE(batch[0] == std::make_pair(handles[0], S::C));
+	REQUIRE(batch[1] == std::make_pair(handles[1], S::B));
+	REQUIRE(batch[2] == std::make_pair(handles[2], S::C));
+	REQUIRE(rules.Fire(h, pool, ctx) == 3);
+	REQUIRE(pool.Members(S::C).size() == 2);
+
+	// From B.
+	pool.Field(Health, handles[1]) = 0;
+	REQUIRE(rules.Fire(h, pool, ctx) == 1);
+	REQUIRE(pool.Members(S::C).size() == 3);
+
+	// Rules are validated by the transition table.
+	REQUIRE_THROWS_AS(Pdfsm::RuleEngine<S>(h, { { S::C, Health, Pdfsm::Comparator::Lt, 20, S::A } }), std::runtime_error);
+	// The pool has fewer fields than the rules read.
+	Pdfsm::StateMachinePool<S> few;
+	few.EnableFields(1);
+	REQUIRE_THROWS_AS(rules.Evaluate(few), std::runtime_error);
+}
+
+TEST_CASE("Pdfsm/28", "[Utility]")
+{
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, transitionTable);
+	Pdfsm::StateMachinePool<S>	  pool;
+	Pdfsm::UtilitySelector<S>	  selector;
+	pool.EnableFields(2);
+	pool.EnableLocks();
+	std::vector<Pdfsm::Handle> handles;
+	for (int i = 0; i < 6; ++i)
+		handles.push_back(pool.New());
+	h.Update(pool, ctx);
+
+	// Scores B by field 0 in batch, and C by field 1 for each.
+	int batches = 0;
+	selector.Score(S::B, [&](const Pdfsm::Handle* hs, std::size_t n, float* scores) {
+		const float* column = pool.Field(0);
+		for (std::size_t i = 0; i < n; ++i)
+			scores[i] = column[hs[i]];
+		++batches;
+	});
+	selector.ScoreEach(S::C, [&](Pdfsm::Handle x) { return pool.Field(1, x); });
+
+	float utilities[6][2] = { { 1, 2 }, { 3, 2 }, { 0, 0 }, { -1, 0.5f }, { 2, 0 }, { 2, 1 } };
+	for (int i = 0; i < 6; ++i)
+		pool.Field(0, handles[i]) = utilities[i][0], pool.Field(1, handles[i]) = utilities[i][1];
+	pool.SetLock(handles[4], S::B, true);
+	REQUIRE(selector.Choose(h, pool, S::A, ctx) == 4);
+	REQUIRE(batches == 1);
+	REQUIRE(pool.Members(S::A).size() == 2); // 2 stays, 4 is locked
+	REQUIRE(pool.Members(S::B).size() == 2); // 1, 5
+	REQUIRE(pool.Members(S::C).size() == 2); // 0, 3
+
+	// All states at once, B may only go C, and a machine transits at most once.
+	pool.Field(0, handles[2]) = 5, pool.Field(1, handles[2]) = 1; // A to B, but not then B to C
+	pool.Field(1, handles[1]) = 0;
+	pool.Field(1, handles[5]) = 3;
+	REQUIRE(selector.Choose(h, pool, ctx) == 2);
+	REQUIRE(pool.Members(S::A).size() == 1);
+	REQUIRE(pool.Members(S::B).size() == 2);
+	REQUIRE(pool.Members(S::C).size() == 3);
+}
+
+TEST_CASE("Pdfsm/29", "[Paths]")
+{
+	Pdfsm::TransitionTable<S> chain = {
+		{ S::A, { S::B } },
+		{ S::B, { S::C } },
+	};
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, chain);
+	Pdfsm::StateMachine<S>		  fsm;
+	REQUIRE(h.IsReachable(S::A, S::C));
+	REQUIRE(!h.IsReachable(S::C, S::A));
+	REQUIRE(h.Distance(S::A, S::A) == 0);
+	REQUIRE(h.Distance(S::A, S::C) == 2);
+	REQUIRE(h.Distance(S::B, S::A) == -1);
+	REQUIRE(h.NextHop(S::A, S::C) == S::B);
+
+	// Locked on the route.
+	Pdfsm::StateMachinePool<S> pool;
+	pool.EnableLocks();
+	auto x = pool.New();
+	h.SetHandlingFsm(pool, x, ctx);
+	pool.SetLock(x, S::B, true);
+	REQUIRE_THROWS_AS(h.JumpPath(ctx, S::C), std::runtime_error);
+	REQUIRE(h.Top() == S::A);
+	h.SetHandlingFsm(fsm, ctx);
+
+	// Through B.
+	h.JumpPath(ctx, S::C);
+	REQUIRE(h.Top() == S::C);
+	REQUIRE(fsm.top == 0);
+	REQUIRE(bb->onEnterCounterB == 1);
+	REQUIRE(bb->onTerminateCounterB == 1);
+	REQUIRE_THROWS_AS(h.JumpPath(ctx, S::A), std::runtime_error);
+	h.JumpPath(ctx, S::C);
+	REQUIRE(bb->onEnterCounterC == 1);
+
+	// Pushes retrace the route on pops.
+	Pdfsm::StateMachine<S> fsm2;
+	h.SetHandlingFsm(fsm2, ctx);
+	h.PushPath(ctx, S::C);
+	REQUIRE(fsm2.top == 2);
+	h.Pop(ctx);
+	REQUIRE(h.Top() == S::B);
+
+	// Wildcards are routed as well.
+	Pdfsm::StateMachineHandler<S> h2(behaviorTable, chain, { { { S::A }, {}, { S::C } } });
+	REQUIRE(h2.Distance(S::C, S::B) == 2);
+
+	// A hook redirecting off the route stops the walk.
+	Pdfsm::StateMachineHandler<S> h3(behaviorTable, Pdfsm::TransitionTable<S>{ { S::A, { S::C } }, { S::C, { S::B } }, { S::B, { S::A, S::C } } });
+	Pdfsm::StateMachine<S>		  fsm3;
+	h3.SetHandlingFsm(fsm3, ctx);
+	h3.Jump(ctx, S::C);
+	bb->jumpOnEnterB = true;
+	h3.JumpPath(ctx, S::A);
+	REQUIRE(h3.Top() == S::C);
+	h3.PushPath(ctx, S::A);
+	REQUIRE(h3.Top() == S::C);
+	REQUIRE(fsm3.top == 1);
+	bb->jumpOnEnterB = false;
+}
+
+TEST_CASE("Pdfsm/30", "[Markov]")
+{
+	Pdfsm::TransitionTable<S> weighted = {
+		{ S::A, { S::B, S::C }, nullptr, { 1, 3 } },
+		{ S::B, { S::A, S::B }, nullptr, { 1, 1 } },
+	};
+	auto						  bb = std::make_shared<Blackboard>();
+	auto						  ctx = Pdfsm::Context(bb);
+	Pdfsm::StateMachineHandler<S> h(behaviorTable, weighted);
+	Pdfsm::MarkovChain<S>		  chain(weighted);
+
+	// Sampling follows the weights, C is absorbing.
+	Pdfsm::CounterRng rng{ 42 };
+	int				  counts[3] = {};
+	for (int i = 0; i < 100000; ++i)
+		++counts[static_cast<int>(chain.Sample(S::A, rng(i)))];
+	REQUIRE(counts[0] == 0);
+	REQUIRE(std::abs(counts[1] - 25000) < 1000);
+	REQUIRE(std::abs(counts[2] - 75000) < 1000);
+	REQUIRE(chain.Sample(S::C, rng(0)) == S::C);
+
+	// Steps are deterministic per seed, and keep the membership index.
+	Pdfsm::StateMachinePool<S> pool1, pool2;
+	for (int i = 0; i < 1000; ++i)
+		pool1.New(), pool2.New();
+	h.Update(pool1, ctx);
+	h.Update(pool2, ctx);
+	Pdfsm::CounterRng rng1{ 7 }, rng2{ 7 };
+	for (int i = 0; i < 5; ++i)
+		chain.Step(pool1, rng1), chain.Step(pool2, rng2);
+	for (Pdfsm::Handle x = 0; x < 1000; ++x)
+		REQUIRE(pool1[x].stack[pool1[x].top] == pool2[x].stack[pool2[x].top]);
+	REQUIRE(pool1.Members(S::A).size() + pool1.Members(S::B).size() + pool1.Members(S::C).size() == 1000);
+	REQUIRE(pool1.Members(S::C).size() > 900);
+	for (auto x : pool1.Members(S::B))
+		REQUIRE(pool1[x].stack[pool1[x].top] == static_cast<int>(S::B));
+
+	// Locked targets are not taken, dormant machines stay.
+	Pdfsm::StateMachinePool<S> pool3;
+	for (int i = 0; i < 100; ++i)
+		pool3.New();
+	h.Update(pool3, ctx);
+	pool3.EnableLocks();
+	pool3.SetLock(S::C, true);
+	pool3.Sleep(0);
+	chain.Step(pool3, rng);
+	REQUIRE(pool3.Members(S::C).empty());
+	REQUIRE(pool3[0].stack[0] == static_cast<int>(S::A));
+
+	// Invalid weights.
+	Pdfsm::TransitionTable<S> invalid1 = { { S::A, { S::B, S::C }, nullptr, { 1 } } };
+	Pdfsm::TransitionTable<S> invalid2 = { { S::A, { S::B }, nullptr, { -1 } } };
+	Pdfsm::TransitionTable<S> invalid3 = { { S::A, { S::B }, nullptr, { 0 } } };
+	REQUIRE_THROWS_AS(Pdfsm::MarkovChain<S>(invalid1), std::runtime_error);
+	REQUIRE_THROWS_AS(Pdfsm::MarkovChain<S>(invalid2), std::runtime_error);
+	REQUIRE_THROWS_AS(Pdfsm::MarkovChain<S>(invalid3), std::runtime_error);
+}
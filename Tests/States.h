@@ -1,6 +1,10 @@
 #include <any>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <tuple>
 #include <vector>
 
 #include "Pdfsm.h"
@@ -38,6 +42,25 @@ struct Blackboard
 	int onResumeCounterA = 0;
 	int onResumeCounterB = 0;
 	int onResumeCounterC = 0;
+
+	// C falls asleep on update if it's not negative.
+	int sleepTicksC = -1;
+	// Called on C's update if set.
+	std::function<void()> onUpdateC;
+
+	// Ticks the asynchronous exiting of A and entering of B take.
+	int exitingTicksA = 1;
+	int enteringTicksB = 1;
+	// B jumps to C on entering if set.
+	bool jumpOnEnterB = false;
+	int onExitingCounterA = 0;
+	int onEnteringCounterB = 0;
+
+	// Events received.
+	std::vector<Pdfsm::Event> events;
+
+	// File descriptors readiness received, as (state, fd, events).
+	std::vector<std::tuple<int, int, std::uint32_t>> ready;
 };
 
 // States
@@ -55,42 +78,36 @@ static Pdfsm::TransitionTable<S> transitionTable = {
 	{ S::B, { S::C } },
 };
 
+// Routes signals to machines whose current state subscribes.
+static Pdfsm::SignalRouter<S, 4> signalRouter;
+
 // BaseState with OnSignal.
 template <auto S>
 class BaseStateBehavior : public Pdfsm::StateBehavior<S>
 {
-protected:
-	std::unique_ptr<Blinker::Connection<4>> signalConnection = nullptr;
-
 public:
 	void OnSetup() override
 	{
-		// Connects to interested signals on initialize.
+		// Subscribes interested signals on initialize, they're delivered by signalRouter.
 		auto patterns = SubscribledSignalPatterns();
 		if (patterns.size())
-			signalConnection = signalBoard.Connect(patterns);
+			signalRouter.Subscribe(S, signalBoard.Match(patterns));
 	}
 
-	bool BeforeUpdate(const Pdfsm::Context& ctx) override
+	void OnEvent(const Pdfsm::Context& ctx, const Pdfsm::Event& event) override
 	{
-		bool abort = false;
-		if (signalConnection != nullptr)
-		{
-			// Poll signals, propagates to OnSignal.
-			signalConnection->Poll([&](Blinker::SignalId signalId, std::any signalData) {
-				abort = OnSignal(ctx, signalId, signalData);
-			});
-		}
-		return abort;
+		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
+		bb->events.push_back(event);
 	}
 
-	// APIs To Override.
-
-	virtual bool OnSignal(const Pdfsm::Context& ctx, Blinker::SignalId signalId,
-		std::any signalData)
+	void OnReady(const Pdfsm::Context& ctx, int fd, std::uint32_t events) override
 	{
-		return false;
+		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
+		bb->ready.emplace_back(static_cast<int>(S), fd, events);
 	}
+
+	// APIs To Override.
+
 	virtual std::vector<std::string_view> SubscribledSignalPatterns() const { return {}; }
 };
 
@@ -103,8 +120,8 @@ public:
 	}
 	// Jumps to B on signal x
 	// Jumps to C on signal y
-	bool OnSignal(const Pdfsm::Context& ctx, Blinker::SignalId signalId,
-		std::any signalData) override
+	bool OnSignal(const Pdfsm::Context& ctx, std::size_t signalId,
+		const std::any& signalData) override
 	{
 		std::cout << "A: on signal: " << std::to_string(signalId) << std::endl;
 		if (signalId == signals.x->Id())
@@ -151,6 +168,12 @@ public:
 		bb->onResumeCounterA++;
 		std::cout << "A: on resume" << std::endl;
 	}
+	float OnExiting(const Pdfsm::Context& ctx) override
+	{
+		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
+		std::cout << "A: on exiting" << std::endl;
+		return static_cast<float>(++bb->onExitingCounterA) / bb->exitingTicksA;
+	}
 };
 
 class B : public BaseStateBehavior<S::B>
@@ -160,8 +183,8 @@ public:
 	{
 		return { "z" };
 	}
-	bool OnSignal(const Pdfsm::Context& ctx, Blinker::SignalId signalId,
-		std::any signalData) override
+	bool OnSignal(const Pdfsm::Context& ctx, std::size_t signalId,
+		const std::any& signalData) override
 	{
 		std::cout << "B: on signal: " << std::to_string(signalId) << std::endl;
 		if (signalId == signals.z->Id())
@@ -182,6 +205,8 @@ public:
 		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
 		bb->onEnterCounterB++;
 		std::cout << "B: on enter" << std::endl;
+		if (bb->jumpOnEnterB)
+			GetHandler().Jump(ctx, S::C);
 	}
 	void OnTerminate(const Pdfsm::Context& ctx) override
 	{
@@ -201,6 +226,12 @@ public:
 		bb->onResumeCounterB++;
 		std::cout << "B: on resume" << std::endl;
 	}
+	float OnEntering(const Pdfsm::Context& ctx) override
+	{
+		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
+		std::cout << "B: on entering" << std::endl;
+		return static_cast<float>(++bb->onEnteringCounterB) / bb->enteringTicksB;
+	}
 };
 
 class C : public BaseStateBehavior<S::C>
@@ -211,6 +242,10 @@ public:
 		auto bb = std::any_cast<std::shared_ptr<Blackboard>>(ctx.data);
 		bb->updateCounterC++;
 		std::cout << "C: on update" << std::endl;
+		if (bb->sleepTicksC >= 0)
+			GetHandler().Sleep(bb->sleepTicksC);
+		if (bb->onUpdateC)
+			bb->onUpdateC();
 	}
 	void OnEnter(const Pdfsm::Context& ctx) override
 	{
@@ -250,3 +285,462 @@ struct Entity
 {
 	Pdfsm::StateMachine<S> fsm;
 };
+
+// Job states, driven by events.
+enum class J
+{
+	Pending,
+	Running,
+	Done,
+	Failed,
+	N
+};
+
+// Job events.
+enum JobEvent : unsigned int
+{
+	Start = 1,
+	Progress,
+	Finish,
+	Fail,
+};
+
+static Pdfsm::TransitionTable<J> jobTransitionTable = {
+	{ J::Pending, { J::Running, J::Failed } },
+	{ J::Running, { J::Done, J::Failed } },
+};
+
+// Job blackboard, shared by threads.
+struct JobBlackboard
+{
+	std::atomic<int> started = 0;
+	std::atomic<int> progressed = 0;
+	std::atomic<int> done = 0;
+	std::atomic<int> failed = 0;
+};
+
+class JobPending : public Pdfsm::B<J::Pending>
+{
+public:
+	void OnEvent(const Pdfsm::Context& ctx, const Pdfsm::Event& event) override
+	{
+		if (event.id == Start)
+			GetHandler().Jump(ctx, J::Running);
+		else if (event.id == Fail)
+			GetHandler().Jump(ctx, J::Failed);
+	}
+};
+
+class JobRunning : public Pdfsm::B<J::Running>
+{
+public:
+	void OnEnter(const Pdfsm::Context& ctx) override
+	{
+		std::any_cast<std::shared_ptr<JobBlackboard>>(ctx.data)->started++;
+	}
+	void OnEvent(const Pdfsm::Context& ctx, const Pdfsm::Event& event) override
+	{
+		if (event.id == Progress)
+			std::any_cast<std::shared_ptr<JobBlackboard>>(ctx.data)->progressed++;
+		else if (event.id == Finish)
+			GetHandler().Jump(ctx, J::Done);
+		else if (event.id == Fail)
+			GetHandler().Jump(ctx, J::Failed);
+	}
+};
+
+class JobDone : public Pdfsm::B<J::Done>
+{
+public:
+	void OnEnter(const Pdfsm::Context& ctx) override
+	{
+		std::any_cast<std::shared_ptr<JobBlackboard>>(ctx.data)->done++;
+		GetHandler().Sleep(); // nothing to do
+	}
+};
+
+class JobFailed : public Pdfsm::B<J::Failed>
+{
+public:
+	void OnEnter(const Pdfsm::Context& ctx) override
+	{
+		std::any_cast<std::shared_ptr<JobBlackboard>>(ctx.data)->failed++;
+	}
+};
+
+// Makes a handler owning a new set of job behaviors, i.e. for each worker thread.
+static std::unique_ptr<Pdfsm::StateMachineHandler<J>> MakeJobHandler()
+{
+	std::vector<std::unique_ptr<Pdfsm::IStateBehavior<J>>> behaviors;
+	behaviors.push_back(std::make_unique<JobPending>());
+	behaviors.push_back(std::make_unique<JobRunning>());
+	behaviors.push_back(std::make_unique<JobDone>());
+	behaviors.push_back(std::make_unique<JobFailed>());
+	return std::make_unique<Pdfsm::StateMachineHandler<J>>(std::move(behaviors), jobTransitionTable);
+}
+
+// Script states, the walking one is authored as a coroutine.
+enum class W
+{
+	Idle,
+	Walk,
+	Done,
+	N
+};
+
+// Script events.
+enum WalkEvent : unsigned int
+{
+	Arrive = 1,
+	Depart,
+};
+
+static Pdfsm::TransitionTable<W> walkTransitionTable = {
+	{ W::Idle, { W::Walk } },
+	{ W::Walk, { W::Idle, W::Done } },
+};
+
+struct WalkBlackboard
+{
+	std::vector<int> trace;
+	int				 arrivedAt = -1;
+	std::atomic<int> arrived = 0;
+};
+
+class WalkIdle : public Pdfsm::B<W::Idle>
+{
+};
+
+class Walking : public Pdfsm::ScriptBehavior<W::Walk>
+{
+public:
+	Pdfsm::Script Run(const Pdfsm::Context& ctx) override
+	{
+		auto bb = std::any_cast<std::shared_ptr<WalkBlackboard>>(ctx.data);
+		bb->trace.push_back(1);
+		co_await Pdfsm::NextTick{};
+		bb->trace.push_back(2);
+		co_await Pdfsm::Delay{ std::chrono::milliseconds(20) };
+		bb->trace.push_back(3);
+		const auto& event = co_await Pdfsm::NextEvent(Arrive);
+		bb->arrivedAt = std::any_cast<int>(event.data);
+		const auto& next = co_await Pdfsm::NextTick{};
+		GetHandler().Jump(next, W::Done);
+	}
+};
+
+class WalkDone : public Pdfsm::B<W::Done>
+{
+};
+
+static Pdfsm::BTable<W> walkBehaviorTable = {
+	std::make_unique<WalkIdle>(),
+	std::make_unique<Walking>(),
+	std::make_unique<WalkDone>(),
+};
+
+// Event driven walking states, i.e. run by an ActorRuntime.
+class EventWalkIdle : public Pdfsm::B<W::Idle>
+{
+public:
+	void OnEvent(const Pdfsm::Context& ctx, const Pdfsm::Event& event) override
+	{
+		if (event.id == Depart)
+			GetHandler().Jump(ctx, W::Walk);
+	}
+};
+
+class EventWalking : public Pdfsm::ScriptBehavior<W::Walk>
+{
+public:
+	Pdfsm::Script Run(const Pdfsm::Context& ctx) override
+	{
+		auto c = ctx; // the argument is invalid after co_await
+		co_await Pdfsm::NextEvent(Arrive);
+		std::any_cast<std::shared_ptr<WalkBlackboard>>(c.data)->arrived++;
+		GetHandler().Jump(c, W::Done);
+	}
+};
+
+// Makes a handler owning a new set of event driven walking behaviors.
+static std::unique_ptr<Pdfsm::StateMachineHandler<W>> MakeWalkHandler()
+{
+	std::vector<std::unique_ptr<Pdfsm::IStateBehavior<W>>> behaviors;
+	behaviors.push_back(std::make_unique<EventWalkIdle>());
+	behaviors.push_back(std::make_unique<EventWalking>());
+	behaviors.push_back(std::make_unique<WalkDone>());
+	return std::make_unique<Pdfsm::StateMachineHandler<W>>(std::move(behaviors), walkTransitionTable);
+}
+
+// Hierarchical states, melee and ranged are substates of combat.
+enum class H
+{
+	Idle,
+	Combat,
+	Melee,
+	Ranged,
+	Stunned,
+	N
+};
+
+static constexpr Pdfsm::Hierarchy<H> hierarchy = {
+	{ H::Melee, H::Combat },
+	{ H::Ranged, H::Combat },
+};
+
+// Any combat substate can be stunned.
+static Pdfsm::TransitionTable<H> hierarchyTransitionTable = {
+	{ H::Idle, { H::Melee } },
+	{ H::Melee, { H::Ranged } },
+	{ H::Combat, { H::Stunned } },
+	{ H::Stunned, { H::Idle } },
+};
+
+struct HierarchyBlackboard
+{
+	std::vector<std::string> trace;
+	bool					 stunned = false;
+};
+
+template <auto X>
+class HierarchyBehavior : public Pdfsm::B<X>
+{
+	static constexpr const char* names[] = { "Idle", "Combat", "Melee", "Ranged", "Stunned" };
+
+protected:
+	void Trace(const Pdfsm::Context& ctx, const std::string& hook)
+	{
+		std::any_cast<std::shared_ptr<HierarchyBlackboard>>(ctx.data)->trace.push_back(hook + " " + names[static_cast<int>(X)]);
+	}
+
+public:
+	void OnEnter(const Pdfsm::Context& ctx) override { Trace(ctx, "enter"); }
+	void OnTerminate(const Pdfsm::Context& ctx) override { Trace(ctx, "terminate"); }
+	void Update(const Pdfsm::Context& ctx) override { Trace(ctx, "update"); }
+};
+
+class HierarchyCombat : public HierarchyBehavior<H::Combat>
+{
+public:
+	bool BeforeUpdate(const Pdfsm::Context& ctx) override
+	{
+		if (!std::any_cast<std::shared_ptr<HierarchyBlackboard>>(ctx.data)->stunned)
+			return false;
+		GetHandler().Jump(ctx, H::Stunned);
+		return true;
+	}
+};
+
+static Pdfsm::BTable<H> hierarchyBehaviorTable = {
+	std::make_unique<HierarchyBehavior<H::Idle>>(),
+	std::make_unique<HierarchyCombat>(),
+	std::make_unique<HierarchyBehavior<H::Melee>>(),
+	std::make_unique<HierarchyBehavior<H::Ranged>>(),
+	std::make_unique<HierarchyBehavior<H::Stunned>>(),
+};
+
+// Orthogonal regions of an NPC, locomotion (Idle, Walk) and emote (Neutral, Happy).
+enum class Npc
+{
+	Idle,
+	Walk,
+	Neutral,
+	Happy,
+	N
+};
+
+static Pdfsm::TransitionTable<Npc> npcTransitionTable = {
+	{ Npc::Idle, { Npc::Walk } },
+	{ Npc::Neutral, { Npc::Happy } },
+	{ Npc::Happy, { Npc::Neutral } },
+};
+
+struct NpcBlackboard
+{
+	int	 updateCounterIdle = 0;
+	int	 updateCounterNeutral = 0;
+	int	 updateCounterHappy = 0;
+	bool walk = false;
+};
+
+class NpcIdle : public Pdfsm::B<Npc::Idle>
+{
+public:
+	void Update(const Pdfsm::Context& ctx) override
+	{
+		auto bb = std::any_cast<std::shared_ptr<NpcBlackboard>>(ctx.data);
+		bb->updateCounterIdle++;
+		if (bb->walk)
+			GetHandler().Jump(ctx, Npc::Walk);
+	}
+};
+
+// Walking makes it happy, a transition of the other region.
+class NpcWalk : public Pdfsm::B<Npc::Walk>
+{
+public:
+	void OnEnter(const Pdfsm::Context& ctx) override { GetHandler().Jump(ctx, Npc::Happy); }
+};
+
+class NpcNeutral : public Pdfsm::B<Npc::Neutral>
+{
+public:
+	void Update(const Pdfsm::Context& ctx) override
+	{
+		std::any_cast<std::shared_ptr<NpcBlackboard>>(ctx.data)->updateCounterNeutral++;
+	}
+};
+
+class NpcHappy : public Pdfsm::B<Npc::Happy>
+{
+public:
+	void Update(const Pdfsm::Context& ctx) override
+	{
+		std::any_cast<std::shared_ptr<NpcBlackboard>>(ctx.data)->updateCounterHappy++;
+	}
+};
+
+static Pdfsm::BTable<Npc> npcBehaviorTable = {
+	std::make_unique<NpcIdle>(),
+	std::make_unique<NpcWalk>(),
+	std::make_unique<NpcNeutral>(),
+	std::make_unique<NpcHappy>(),
+};
+
+// Nested machines, the combat state runs a child machine of combat states.
+enum class P
+{
+	Idle,
+	Combat,
+	N
+};
+
+enum class CombatState
+{
+	Approach,
+	Attack,
+	N
+};
+
+static Pdfsm::TransitionTable<P>		   nestedTransitionTable = { { P::Idle, { P::Combat } }, { P::Combat, { P::Idle } } };
+static Pdfsm::TransitionTable<CombatState> combatTransitionTable = { { CombatState::Approach, { CombatState::Attack } } };
+
+struct NestedBlackboard
+{
+	int					 updateCounterApproach = 0;
+	int					 updateCounterAttack = 0;
+	int					 onTerminateCounterAttack = 0;
+	int					 onPauseCounterAttack = 0;
+	int					 onResumeCounterAttack = 0;
+	bool				 inRange = false;
+	std::vector<unsigned int> events;
+};
+
+class CombatApproach : public Pdfsm::B<CombatState::Approach>
+{
+public:
+	void Update(const Pdfsm::Context& ctx) override
+	{
+		auto bb = std::any_cast<std::shared_ptr<NestedBlackboard>>(ctx.data);
+		bb->updateCounterApproach++;
+		if (bb->inRange)
+			GetHandler().Jump(ctx, CombatState::Attack);
+	}
+};
+
+class CombatAttack : public Pdfsm::B<CombatState::Attack>
+{
+	std::shared_ptr<NestedBlackboard> Bb(const Pdfsm::Context& ctx) { return std::any_cast<std::shared_ptr<NestedBlackboard>>(ctx.data); }
+
+public:
+	void Update(const Pdfsm::Context& ctx) override { Bb(ctx)->updateCounterAttack++; }
+	void OnTerminate(const Pdfsm::Context& ctx) override { Bb(ctx)->onTerminateCounterAttack++; }
+	void OnPause(const Pdfsm::Context& ctx) override { Bb(ctx)->onPauseCounterAttack++; }
+	void OnResume(const Pdfsm::Context& ctx) override { Bb(ctx)->onResumeCounterAttack++; }
+	void OnEvent(const Pdfsm::Context& ctx, const Pdfsm::Event& event) override { Bb(ctx)->events.push_back(event.id); }
+};
+
+static Pdfsm::BTable<CombatState> combatBehaviorTable = {
+	std::make_unique<CombatApproach>(),
+	std::make_unique<CombatAttack>(),
+};
+
+class NestedIdle : public Pdfsm::B<P::Idle>
+{
+};
+
+class NestedCombat : public Pdfsm::SubMachineBehavior<P::Combat, CombatState>
+{
+public:
+	NestedCombat()
+		: SubMachineBehavior(combatBehaviorTable, combatTransitionTable) {}
+};
+
+static Pdfsm::BTable<P> nestedBehaviorTable = {
+	std::make_unique<NestedIdle>(),
+	std::make_unique<NestedCombat>(),
+};
+
+// States with data.
+enum class D
+{
+	Idle,
+	Patrol,
+	Escort,
+	N
+};
+
+static Pdfsm::TransitionTable<D> dataTransitionTable = {
+	{ D::Idle, { D::Patrol, D::Escort } },
+	{ D::Patrol, { D::Idle } },
+	{ D::Escort, { D::Idle } },
+};
+
+struct PatrolData
+{
+	int					 waypoint = 0;
+	int					 ticks = 0;
+	std::shared_ptr<int> token;
+};
+
+// Escort data can't be constructed by default, it counts destructions.
+static int escortDestroyed = 0;
+
+struct EscortData
+{
+	explicit EscortData(int target) : target(target) {}
+	EscortData(const EscortData&) = default;
+	~EscortData() { ++escortDestroyed; }
+	int target;
+};
+
+struct DataBlackboard
+{
+	int waypoint = -1;
+	int ticks = 0;
+	int paused = 0;
+};
+
+class DataIdle : public Pdfsm::B<D::Idle>
+{
+};
+
+class DataPatrol : public Pdfsm::DataBehavior<D::Patrol, PatrolData>
+{
+	std::shared_ptr<DataBlackboard> Bb(const Pdfsm::Context& ctx) { return std::any_cast<std::shared_ptr<DataBlackboard>>(ctx.data); }
+
+public:
+	void OnEnter(const Pdfsm::Context& ctx, PatrolData& data) override { Bb(ctx)->waypoint = data.waypoint; }
+	void OnPause(const Pdfsm::Context& ctx, PatrolData& data) override { Bb(ctx)->paused++; }
+	void Update(const Pdfsm::Context& ctx, PatrolData& data) override { Bb(ctx)->ticks = ++data.ticks; }
+};
+
+class DataEscort : public Pdfsm::DataBehavior<D::Escort, EscortData>
+{
+};
+
+static Pdfsm::BTable<D> dataBehaviorTable = {
+	std::make_unique<DataIdle>(),
+	std::make_unique<DataPatrol>(),
+	std::make_unique<DataEscort>(),
+};